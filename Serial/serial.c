@@ -19,6 +19,7 @@
 // 	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // 	SOFTWARE.
 
+#include <stdarg.h>
 #include <time.h>
 #include "serial.h"
 
@@ -48,62 +49,437 @@ void Serial_ShowError(LPSTR lpszFunction)
 	}
 }
 
+// Capture in progress, see Serial_StartCapture
+#define SERIAL_CAPTURE_NONE 0xFFFFFFFF
+typedef struct Serial_Capture
+{
+	HANDLE File;
+	HANDLE Mapping;
+	Serial_LogHeader *Header;	// Start of the mapped log.
+	LONG64 Capacity;			// Bytes available for records.
+	volatile LONG64 Reserved;	// Bytes of records handed out so far.
+	LONGLONG Start;				// Performance counter when the capture started.
+	volatile LONG Dropped;		// Chunks which didn't fit.
+	LONG64 MergeGap;			// Largest gap in microseconds between chunks merged into one record.
+	volatile LONG Appending;	// Set while a thread owns the members below.
+	Serial_LogRecord *Last;		// Last record written with room for more data, or NULL.
+	LONG64 LastEnd;				// Offset just past Last.
+	LONG64 LastTime;			// Microseconds when the last chunk was captured.
+	DWORD LastDirection;		// Direction of the last chunk, or SERIAL_CAPTURE_NONE.
+} Serial_Capture;
+
+// Replay source, see Serial_OpenReplay
+typedef struct Serial_Replay
+{
+	HANDLE Mapping;
+	const unsigned char *Records;	// First record in the mapped log.
+	LONG64 Size;					// Bytes of records.
+	LONG64 Next;					// Offset of the record being returned.
+	DWORD Offset;					// Bytes of that record already returned.
+	int Realtime;
+	LONGLONG Start;					// Performance counter when the first byte was read.
+} Serial_Replay;
+
+// Per handle state, found by Serial_FindPort
+typedef struct Serial_PortState
+{
+	HANDLE volatile Handle;
+	Serial_Stats Stats;
+	Serial_Capture *Capture;
+	Serial_Replay *Replay;
+} Serial_PortState;
+
+static Serial_PortState Serial_PortTable[SERIAL_MAX_OPEN_PORTS];
+static volatile LONG Serial_PortTableUsed = 0;
+static LARGE_INTEGER Serial_TimerFrequency;
+
 /*
- * Function: Serial_OpenPort
- * Opens serial port.
+ * Function: Serial_FindPort
+ * Finds the state kept for a handle.
  *
  * Parameters:
- * nComPort - Serial port to open 1 - 255.
- * nBaudRate - Baud rate for the serial port.
- * nDatabits - Number of data bits.
- * nParity - Parity to use.
- * nStopbits - Number of stop bits.
- * nHandshake - Type of handshaking to use.
+ * Serial_Handle - Handle to the serial port.
  *
  * Returns:
- * Returns HANDLE or NULL on error.
+ * (Serial_PortState *) - Pointer to the state or NULL if the handle isn't attached.
  *
  */
-HANDLE Serial_OpenPort(unsigned char nComPort, DWORD nBaudRate, unsigned char nDatabits, unsigned char nParity, unsigned char nStopbits, unsigned char nHandshake)
+static Serial_PortState *Serial_FindPort(HANDLE Serial_Handle)
 {
-	char szComPort[20];
-	COMMTIMEOUTS ct;
-	DCB dcbCommPort;
-	HANDLE Serial_Handle;
+	LONG used = Serial_PortTableUsed;
+	LONG i;
 
-	// Check com-port data
-	if (nComPort != 0)
+	// A free table entry has a NULL handle, so never hand one out for it.
+	if (Serial_Handle == NULL || Serial_Handle == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	for (i = 0; i < used; i++)
 	{
-		sprintf(szComPort, "\\\\.\\COM%d", nComPort);
+		if (Serial_PortTable[i].Handle == Serial_Handle)
+			return &Serial_PortTable[i];
+	}
+	return NULL;
+}
+
+/*
+ * Function: Serial_PollErrors
+ * Reads and clears the port's communication errors, adding them to its statistics.
+ * ClearCommError only reports whether each kind of error happened since the last poll,
+ * so each kind is counted at most once per poll however many there were.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * Port - Pointer to the state for the handle.
+ *
+ * Returns:
+ * void.
+ */
+static void Serial_PollErrors(HANDLE Serial_Handle, Serial_PortState *Port)
+{
+	COMSTAT status;
+	DWORD errors = 0;
+
+	if (!ClearCommError(Serial_Handle, &errors, &status))
+		return;
+
+	if (errors & (CE_OVERRUN | CE_RXOVER))
+		InterlockedIncrement64(&Port->Stats.Overruns);
+	if (errors & CE_FRAME)
+		InterlockedIncrement64(&Port->Stats.FramingErrors);
+	if (errors & CE_RXPARITY)
+		InterlockedIncrement64(&Port->Stats.ParityErrors);
+	if (errors & CE_BREAK)
+		InterlockedIncrement64(&Port->Stats.Breaks);
+}
+
+/*
+ * Function: Serial_CaptureData
+ * Appends a timestamped chunk of data to a capture log. Space is reserved with a single
+ * interlocked add, so the reader thread and a writing thread can capture at once.
+ * A chunk following one in the same direction within the merge gap, a few character
+ * times, is part of a stream. It is added to the last record while that is still the
+ * last in the log and has room, otherwise a small one gets a record with room for
+ * SERIAL_CAPTURE_MERGE_SIZE bytes. Reading a byte at a time doesn't then grow the log
+ * 32 fold, and lone chunks aren't padded. Merged data is replayed at the time of the
+ * first chunk.
+ *
+ * Parameters:
+ * Capture - Pointer to the capture.
+ * Direction - SERIAL_CAPTURE_RX or SERIAL_CAPTURE_TX.
+ * Data - Pointer to the data.
+ * Length - Number of bytes of data.
+ *
+ * Returns:
+ * void.
+ */
+static void Serial_CaptureData(Serial_Capture *Capture, DWORD Direction, const void *Data, DWORD Length)
+{
+	Serial_LogRecord *record;
+	LARGE_INTEGER now;
+	LONG64 room = (Length + 7) & ~7;
+	LONG64 time;
+	LONG64 size;
+	LONG64 offset;
+	int appending;
+	int streaming;
+
+	QueryPerformanceCounter(&now);
+	time = (now.QuadPart - Capture->Start) * 1000000 / Serial_TimerFrequency.QuadPart;
+
+	// Only one thread at a time may add to the last record, any other writes its own.
+	appending = InterlockedCompareExchange(&Capture->Appending, 1, 0) == 0;
+	if (appending)
+	{
+		streaming = Capture->LastDirection == Direction && time - Capture->LastTime <= Capture->MergeGap;
+		Capture->LastDirection = Direction;
+		Capture->LastTime = time;
+
+		record = Capture->Last;
+		if (streaming && record != NULL && Length <= record->Size - sizeof(Serial_LogRecord) - record->Length &&
+			InterlockedCompareExchange64(&Capture->Reserved, 0, 0) == Capture->LastEnd)
+		{
+			memcpy((unsigned char *)(record + 1) + record->Length, Data, Length);
+
+			// The data goes in before the length, as it does for Size below.
+			MemoryBarrier();
+			record->Length += Length;
+			InterlockedExchange(&Capture->Appending, 0);
+			return;
+		}
+
+		if (streaming && room < SERIAL_CAPTURE_MERGE_SIZE)
+			room = SERIAL_CAPTURE_MERGE_SIZE;
+		Capture->Last = NULL;
+	}
+
+	size = sizeof(Serial_LogRecord) + room;
+	offset = InterlockedExchangeAdd64(&Capture->Reserved, size);
+	if (offset + size > Capture->Capacity)
+	{
+		InterlockedIncrement(&Capture->Dropped);
+		if (appending)
+			InterlockedExchange(&Capture->Appending, 0);
+		return;
+	}
+
+	record = (Serial_LogRecord *)((unsigned char *)(Capture->Header + 1) + offset);
+	record->Time = time;
+	record->Length = Length;
+	record->Direction = Direction;
+	memcpy(record + 1, Data, Length);
+
+	// Size goes in last, a reader of a log that was never stopped ends at a zero size.
+	MemoryBarrier();
+	record->Size = (DWORD)size;
+
+	if (appending)
+	{
+		if ((LONG64)Length < room)
+		{
+			Capture->Last = record;
+			Capture->LastEnd = offset + size;
+		}
+		InterlockedExchange(&Capture->Appending, 0);
+	}
+}
+
+/*
+ * Function: Serial_ReplayRecord
+ * Finds the next received chunk in a replay, skipping transmitted ones. The log ends
+ * at the first record which doesn't fit in it or whose data doesn't fit in the record.
+ *
+ * Parameters:
+ * Replay - Pointer to the replay.
+ *
+ * Returns:
+ * (const Serial_LogRecord *) - Pointer to the record or NULL at the end of the log.
+ *
+ */
+static const Serial_LogRecord *Serial_ReplayRecord(Serial_Replay *Replay)
+{
+	const Serial_LogRecord *record;
+
+	while (Replay->Next + (LONG64)sizeof(Serial_LogRecord) <= Replay->Size)
+	{
+		record = (const Serial_LogRecord *)(Replay->Records + Replay->Next);
+		if (record->Size < sizeof(Serial_LogRecord) || Replay->Next + (LONG64)record->Size > Replay->Size)
+			break;
+
+		// A record claiming more data than it holds means the log is corrupt, stop there.
+		if (record->Length > record->Size - sizeof(Serial_LogRecord))
+			break;
+
+		if (record->Direction == SERIAL_CAPTURE_RX && Replay->Offset < record->Length)
+			return record;
+
+		Replay->Next += record->Size;
+		Replay->Offset = 0;
+	}
+
+	return NULL;
+}
+
+/*
+ * Function: Serial_ReplayRead
+ * Reads from a replay as ReadFile would read from a port. In real time mode data isn't
+ * returned before its recorded time, waiting up to the 200ms read timeout for it.
+ *
+ * Parameters:
+ * Replay - Pointer to the replay.
+ * Buffer - Pointer to the buffer to read into.
+ * Size - Number of bytes to read.
+ * BytesRead - Pointer to receive the number of bytes read.
+ *
+ * Returns:
+ * (BOOL) - TRUE, or FALSE with ERROR_HANDLE_EOF at the end of the log.
+ *
+ */
+static BOOL Serial_ReplayRead(Serial_Replay *Replay, void *Buffer, DWORD Size, DWORD *BytesRead)
+{
+	const Serial_LogRecord *record;
+	LARGE_INTEGER now;
+	LONGLONG wait;
+	DWORD count;
+
+	*BytesRead = 0;
+
+	record = Serial_ReplayRecord(Replay);
+	if (record == NULL)
+	{
+		SetLastError(ERROR_HANDLE_EOF);
+		return FALSE;
+	}
+
+	if (Replay->Realtime)
+	{
+		QueryPerformanceCounter(&now);
+		if (Replay->Start == 0)
+			Replay->Start = now.QuadPart - record->Time * Serial_TimerFrequency.QuadPart / 1000000;
+
+		wait = record->Time - (now.QuadPart - Replay->Start) * 1000000 / Serial_TimerFrequency.QuadPart;
+		if (wait > 0)
+		{
+			if (wait > 200000)
+			{
+				Sleep(200);
+				return TRUE;
+			}
+			Sleep((DWORD)((wait + 999) / 1000));
+		}
 	}
+
+	count = record->Length - Replay->Offset;
+	if (count > Size)
+		count = Size;
+
+	memcpy(Buffer, (const unsigned char *)(record + 1) + Replay->Offset, count);
+	Replay->Offset += count;
+	*BytesRead = count;
+
+	return TRUE;
+}
+
+/*
+ * Function: Serial_Read
+ * ReadFile wrapper used by all of the read functions, keeps the statistics for the handle.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * Buffer - Pointer to the buffer to read into.
+ * Size - Number of bytes to read.
+ * BytesRead - Pointer to receive the number of bytes read.
+ *
+ * Returns:
+ * (BOOL) - The ReadFile result.
+ *
+ */
+static BOOL Serial_Read(HANDLE Serial_Handle, void *Buffer, DWORD Size, DWORD *BytesRead)
+{
+	Serial_PortState *port = Serial_FindPort(Serial_Handle);
+	LARGE_INTEGER start, end;
+	LONGLONG elapsed;
+	BOOL result;
+	int bucket = 0;
+
+	if (port == NULL)
+		return ReadFile(Serial_Handle, Buffer, Size, BytesRead, NULL);
+
+	QueryPerformanceCounter(&start);
+	if (port->Replay != NULL)
+		result = Serial_ReplayRead(port->Replay, Buffer, Size, BytesRead);
 	else
+		result = ReadFile(Serial_Handle, Buffer, Size, BytesRead, NULL);
+	QueryPerformanceCounter(&end);
+
+	InterlockedIncrement64(&port->Stats.ReadCalls);
+	if (!result)
 	{
-		return INVALID_HANDLE_VALUE;
+		// Keep the ReadFile error for the caller, the end of a replay isn't counted.
+		DWORD error = GetLastError();
+		if (port->Replay == NULL)
+		{
+			InterlockedIncrement64(&port->Stats.ReadErrors);
+			Serial_PollErrors(Serial_Handle, port);
+		}
+		SetLastError(error);
+	}
+	else if (*BytesRead == 0)
+	{
+		InterlockedIncrement64(&port->Stats.ReadTimeouts);
+	}
+	else
+	{
+		InterlockedExchangeAdd64(&port->Stats.BytesRead, *BytesRead);
+		if (port->Capture != NULL)
+			Serial_CaptureData(port->Capture, SERIAL_CAPTURE_RX, Buffer, *BytesRead);
 	}
 
-	Serial_Handle = CreateFile(szComPort, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
-	if (Serial_Handle == INVALID_HANDLE_VALUE)
+	// A short read means the port ran dry, collect line errors then rather than once per byte.
+	if (result && *BytesRead < Size && port->Replay == NULL)
+		Serial_PollErrors(Serial_Handle, port);
+
+	// Microseconds, then the power of two bucket they fall in.
+	elapsed = (end.QuadPart - start.QuadPart) * 1000000 / Serial_TimerFrequency.QuadPart;
+	while (elapsed > 0 && bucket < SERIAL_LATENCY_BUCKETS - 1)
 	{
-		Serial_ShowError("CreateFile");
-		return INVALID_HANDLE_VALUE;
+		elapsed >>= 1;
+		bucket++;
 	}
+	InterlockedIncrement64(&port->Stats.ReadLatency[bucket]);
 
-	memset(&ct, 0, sizeof(ct));
+	return result;
+}
+
+/*
+ * Function: Serial_Write
+ * WriteFile wrapper used by all of the write functions, keeps the statistics for the handle.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * Buffer - Pointer to the data to write.
+ * Size - Number of bytes to write.
+ * BytesWritten - Pointer to receive the number of bytes written.
+ *
+ * Returns:
+ * (BOOL) - The WriteFile result.
+ *
+ */
+static BOOL Serial_Write(HANDLE Serial_Handle, const void *Buffer, DWORD Size, DWORD *BytesWritten)
+{
+	Serial_PortState *port = Serial_FindPort(Serial_Handle);
+	BOOL result;
 
-	// Set timeouts
-	ct.ReadIntervalTimeout = MAXDWORD;
-	ct.ReadTotalTimeoutMultiplier = MAXDWORD;
-	ct.ReadTotalTimeoutConstant = 200;
-	ct.WriteTotalTimeoutMultiplier = 0;
-	ct.WriteTotalTimeoutConstant = 200;
-	SetCommTimeouts(Serial_Handle, &ct);
+	if (port == NULL)
+		return WriteFile(Serial_Handle, Buffer, Size, BytesWritten, NULL);
 
-	// Comm state
-	if (!GetCommState(Serial_Handle, &dcbCommPort))
+	// Nothing is listening to a replay, pretend the write went.
+	if (port->Replay != NULL)
 	{
-		CloseHandle(Serial_Handle);
-		return INVALID_HANDLE_VALUE;
+		*BytesWritten = Size;
+		result = TRUE;
 	}
+	else
+	{
+		result = WriteFile(Serial_Handle, Buffer, Size, BytesWritten, NULL);
+	}
+
+	InterlockedIncrement64(&port->Stats.WriteCalls);
+	if (result)
+	{
+		InterlockedExchangeAdd64(&port->Stats.BytesWritten, *BytesWritten);
+		if (port->Capture != NULL && *BytesWritten != 0)
+			Serial_CaptureData(port->Capture, SERIAL_CAPTURE_TX, Buffer, *BytesWritten);
+	}
+	if (!result || *BytesWritten != Size)
+		InterlockedIncrement64(&port->Stats.WriteErrors);
+
+	return result;
+}
+
+/*
+ * Function: Serial_Configure
+ * Sets the line settings, handshaking and profile of an open port.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * nBaudRate - Baud rate for the serial port.
+ * nDatabits - Number of data bits.
+ * nParity - Parity to use.
+ * nStopbits - Number of stop bits.
+ * nHandshake - Type of handshaking to use.
+ * nProfile - SERIAL_PROFILE_DEFAULT, SERIAL_PROFILE_LOW_LATENCY or SERIAL_PROFILE_THROUGHPUT.
+ *
+ * Returns:
+ * (BOOL) - non zero on success, GetLastError has the reason for a failure.
+ *
+ */
+static BOOL Serial_Configure(HANDLE Serial_Handle, DWORD nBaudRate, unsigned char nDatabits, unsigned char nParity, unsigned char nStopbits, unsigned char nHandshake, int nProfile)
+{
+	DCB dcbCommPort;
+
+	// Comm state
+	if (!GetCommState(Serial_Handle, &dcbCommPort))
+		return FALSE;
 
 	dcbCommPort.DCBlength = sizeof(DCB);
 	dcbCommPort.BaudRate = nBaudRate;
@@ -118,6 +494,7 @@ HANDLE Serial_OpenPort(unsigned char nComPort, DWORD nBaudRate, unsigned char nD
 
 	dcbCommPort.Parity = nParity;
 	dcbCommPort.fDtrControl = DTR_CONTROL_ENABLE;
+	dcbCommPort.fAbortOnError = FALSE;
 	dcbCommPort.ByteSize = nDatabits;
 	dcbCommPort.StopBits = nStopbits;
 
@@ -145,324 +522,2183 @@ HANDLE Serial_OpenPort(unsigned char nComPort, DWORD nBaudRate, unsigned char nD
 	{
 		//  HANDSHAKE_NONE
 
-		// Software flow control
-		dcbCommPort.fOutX = FALSE;
-		dcbCommPort.fInX = FALSE;
+		// Software flow control
+		dcbCommPort.fOutX = FALSE;
+		dcbCommPort.fInX = FALSE;
+
+		// Hardware flow control
+		dcbCommPort.fOutxCtsFlow = FALSE;
+		dcbCommPort.fOutxDsrFlow = FALSE;
+	}
+
+	if (!SetCommState(Serial_Handle, &dcbCommPort))
+		return FALSE;
+
+	// Buffer sizes and timeouts
+	return Serial_SetProfile(Serial_Handle, nProfile);
+}
+
+/*
+ * Function: Serial_Open
+ * Opens and configures a serial port and starts keeping statistics for it.
+ *
+ * Parameters:
+ * nComPort - Serial port to open 1 - 255.
+ * nBaudRate - Baud rate for the serial port.
+ * nDatabits - Number of data bits.
+ * nParity - Parity to use.
+ * nStopbits - Number of stop bits.
+ * nHandshake - Type of handshaking to use.
+ * nProfile - SERIAL_PROFILE_DEFAULT, SERIAL_PROFILE_LOW_LATENCY or SERIAL_PROFILE_THROUGHPUT.
+ * ShowErrors - non zero to report a failed CreateFile with Serial_ShowError.
+ * Error - Pointer to receive the GetLastError value of a failure.
+ *
+ * Returns:
+ * Returns HANDLE or INVALID_HANDLE_VALUE on error.
+ *
+ */
+static HANDLE Serial_Open(unsigned char nComPort, DWORD nBaudRate, unsigned char nDatabits, unsigned char nParity, unsigned char nStopbits, unsigned char nHandshake, int nProfile, BOOL ShowErrors, DWORD *Error)
+{
+	char szComPort[20];
+	HANDLE Serial_Handle;
+
+	// Check com-port data
+	if (nComPort != 0)
+	{
+		sprintf(szComPort, "\\\\.\\COM%d", nComPort);
+	}
+	else
+	{
+		*Error = ERROR_INVALID_PARAMETER;
+		return INVALID_HANDLE_VALUE;
+	}
+
+	Serial_Handle = CreateFile(szComPort, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (Serial_Handle == INVALID_HANDLE_VALUE)
+	{
+		*Error = GetLastError();
+		if (ShowErrors)
+			Serial_ShowError("CreateFile");
+		return INVALID_HANDLE_VALUE;
+	}
+
+	if (!Serial_Configure(Serial_Handle, nBaudRate, nDatabits, nParity, nStopbits, nHandshake, nProfile))
+	{
+		*Error = GetLastError();
+		CloseHandle(Serial_Handle);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	Serial_AttachHandle(Serial_Handle);
+
+	*Error = 0;
+	return Serial_Handle;
+}
+
+/*
+ * Function: Serial_OpenPort
+ * Opens serial port with the default profile.
+ *
+ * Parameters:
+ * nComPort - Serial port to open 1 - 255.
+ * nBaudRate - Baud rate for the serial port.
+ * nDatabits - Number of data bits.
+ * nParity - Parity to use.
+ * nStopbits - Number of stop bits.
+ * nHandshake - Type of handshaking to use.
+ *
+ * Returns:
+ * Returns HANDLE or INVALID_HANDLE_VALUE on error.
+ *
+ */
+HANDLE Serial_OpenPort(unsigned char nComPort, DWORD nBaudRate, unsigned char nDatabits, unsigned char nParity, unsigned char nStopbits, unsigned char nHandshake)
+{
+	return Serial_OpenPortEx(nComPort, nBaudRate, nDatabits, nParity, nStopbits, nHandshake, SERIAL_PROFILE_DEFAULT);
+}
+
+/*
+ * Function: Serial_OpenPortEx
+ * Opens serial port with a profile, see Serial_SetProfile.
+ *
+ * Parameters:
+ * nComPort - Serial port to open 1 - 255.
+ * nBaudRate - Baud rate for the serial port.
+ * nDatabits - Number of data bits.
+ * nParity - Parity to use.
+ * nStopbits - Number of stop bits.
+ * nHandshake - Type of handshaking to use.
+ * nProfile - SERIAL_PROFILE_DEFAULT, SERIAL_PROFILE_LOW_LATENCY or SERIAL_PROFILE_THROUGHPUT.
+ *
+ * Returns:
+ * Returns HANDLE or INVALID_HANDLE_VALUE on error.
+ *
+ */
+HANDLE Serial_OpenPortEx(unsigned char nComPort, DWORD nBaudRate, unsigned char nDatabits, unsigned char nParity, unsigned char nStopbits, unsigned char nHandshake, int nProfile)
+{
+	DWORD error;
+
+	return Serial_Open(nComPort, nBaudRate, nDatabits, nParity, nStopbits, nHandshake, nProfile, TRUE, &error);
+}
+
+/*
+ * Function: Serial_SetProfile
+ * Sets the driver buffer sizes and timeouts for a port, trading latency against
+ * throughput. Can be called at any time, the timeouts apply to the next read or write.
+ * Buffer sizes are a request to the driver, which some drivers only act on at open.
+ *
+ * SERIAL_PROFILE_DEFAULT - SERIAL_IN_BUFFER_SIZE and SERIAL_OUT_BUFFER_SIZE buffers, reads
+ * return as soon as any data has arrived or after 200ms.
+ *
+ * SERIAL_PROFILE_LOW_LATENCY - SERIAL_LOW_LATENCY_BUFFER_SIZE buffers, reads return as soon
+ * as any data has arrived or after 1ms, so a polling loop reacts within a millisecond.
+ *
+ * SERIAL_PROFILE_THROUGHPUT - SERIAL_THROUGHPUT_BUFFER_SIZE buffers, reads carry on until
+ * the buffer is full or the line has been quiet for SERIAL_THROUGHPUT_GAP, so block reads
+ * such as Serial_GetFrame take a whole burst per call.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * nProfile - SERIAL_PROFILE_DEFAULT, SERIAL_PROFILE_LOW_LATENCY or SERIAL_PROFILE_THROUGHPUT.
+ *
+ * Returns:
+ * (int) - non zero on success.
+ *
+ */
+int Serial_SetProfile(HANDLE Serial_Handle, int nProfile)
+{
+	COMMTIMEOUTS ct;
+	DCB dcbCommPort;
+	DWORD insize, outsize;
+
+	memset(&ct, 0, sizeof(ct));
+
+	if (nProfile == SERIAL_PROFILE_LOW_LATENCY)
+	{
+		insize = outsize = SERIAL_LOW_LATENCY_BUFFER_SIZE;
+		ct.ReadIntervalTimeout = MAXDWORD;
+		ct.ReadTotalTimeoutMultiplier = MAXDWORD;
+		ct.ReadTotalTimeoutConstant = 1;
+		ct.WriteTotalTimeoutMultiplier = 0;
+		ct.WriteTotalTimeoutConstant = 200;
+	}
+	else if (nProfile == SERIAL_PROFILE_THROUGHPUT)
+	{
+		insize = outsize = SERIAL_THROUGHPUT_BUFFER_SIZE;
+		ct.ReadIntervalTimeout = SERIAL_THROUGHPUT_GAP;
+		ct.ReadTotalTimeoutMultiplier = 0;
+		ct.ReadTotalTimeoutConstant = 200;
+
+		// Allow large writes the time they take at the baud rate, 10 bits per character.
+		dcbCommPort.DCBlength = sizeof(DCB);
+		if (GetCommState(Serial_Handle, &dcbCommPort) && dcbCommPort.BaudRate != 0)
+			ct.WriteTotalTimeoutMultiplier = 10000 / dcbCommPort.BaudRate + 1;
+		ct.WriteTotalTimeoutConstant = 200;
+	}
+	else
+	{
+		insize = SERIAL_IN_BUFFER_SIZE;
+		outsize = SERIAL_OUT_BUFFER_SIZE;
+		ct.ReadIntervalTimeout = MAXDWORD;
+		ct.ReadTotalTimeoutMultiplier = MAXDWORD;
+		ct.ReadTotalTimeoutConstant = 200;
+		ct.WriteTotalTimeoutMultiplier = 0;
+		ct.WriteTotalTimeoutConstant = 200;
+	}
+
+	// Not all drivers support resizing their buffers, that isn't worth failing for.
+	SetupComm(Serial_Handle, insize, outsize);
+
+	return SetCommTimeouts(Serial_Handle, &ct) != 0;
+}
+
+/*
+ * Function: Serial_ClosePort
+ * Closes a serial port opened with the OpenPort function.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port
+ *
+ * Returns:
+ * void.
+ */
+void Serial_ClosePort(HANDLE Serial_Handle)
+{
+	Serial_PortState *port = Serial_FindPort(Serial_Handle);
+
+	if (port == NULL || port->Replay == NULL)
+		PurgeComm(Serial_Handle, PURGE_TXCLEAR | PURGE_RXCLEAR);
+
+	Serial_DetachHandle(Serial_Handle);
+	CloseHandle(Serial_Handle);
+
+	Serial_Handle = INVALID_HANDLE_VALUE;
+}
+
+/*
+ * Function: Serial_PutByte
+ * Places a string in the serial output buffer
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * c - Character to place in the serial output buffer.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_PutByte(HANDLE Serial_Handle, unsigned char c)
+{
+	DWORD cnt;
+	Serial_Write(Serial_Handle, &c, 1, &cnt);
+}
+
+/*
+ * Function: Serial_PutString
+ * Places a string in the serial output buffer.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * c - Pointer to string to send to the serial port.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_PutString(HANDLE Serial_Handle, char *cstring)
+{
+	DWORD cnt;
+	Serial_Write(Serial_Handle, cstring, strlen(cstring), &cnt);
+}
+
+/*
+ * Function: Serial_GetByte
+ * Reads a character from the serial port
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * c - Pointer to unsigned char to receive the read character
+ *
+ * Returns:
+ * (int ) - 0 = Nothing read
+ *			1 = Byte read
+ *
+ */
+int Serial_GetByte(HANDLE Serial_Handle, unsigned char *c)
+{
+	DWORD bytesread = 0;
+	if (Serial_Read(Serial_Handle, c, 1, &bytesread) == 0 && GetLastError() != ERROR_HANDLE_EOF)
+	{
+		Serial_ShowError("Serial_GetByte");
+	}
+	return bytesread;
+}
+
+/*
+ * Function: Serial_Flush
+ * Clears the serial input and output buffers
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port
+ *
+ * Returns:
+ * void.
+ */
+void Serial_Flush(HANDLE Serial_Handle)
+{
+	PurgeComm(Serial_Handle, PURGE_RXCLEAR | PURGE_TXCLEAR);
+}
+
+/*
+ * Function: Serial_FlushRX
+ * Clears the serial input buffer
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port
+ *
+ * Returns:
+ * void.
+ */
+void Serial_FlushRX(HANDLE Serial_Handle)
+{
+	PurgeComm(Serial_Handle, PURGE_RXCLEAR);
+}
+
+/*
+ * Function: Serial_FlushTX
+ * Clears the serial transmit buffer
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_FlushTX(HANDLE Serial_Handle)
+{
+	PurgeComm(Serial_Handle, PURGE_TXCLEAR);
+}
+
+/*
+ * Function: Serial_Break
+ * Put the serial port into a break state
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_Break(HANDLE Serial_Handle)
+{
+	SetCommBreak(Serial_Handle);
+}
+
+/*
+ * Function: Serial_ClearBreak
+ * Clear the serial break state
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_ClearBreak(HANDLE Serial_Handle)
+{
+	ClearCommBreak(Serial_Handle);
+}
+
+/*
+ * Function: Serial_ClearDTR
+ * Clear the DTR Line
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_ClearDTR(HANDLE Serial_Handle)
+{
+	EscapeCommFunction(Serial_Handle, CLRDTR);
+}
+
+/*
+ * Function: Serial_SetDTR
+ * Set the DTR Line
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_SetDTR(HANDLE Serial_Handle)
+{
+	EscapeCommFunction(Serial_Handle, SETDTR);
+}
+
+/*
+ * Function: Serial_SetRTS
+ * Set the RTS Line
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_SetRTS(HANDLE Serial_Handle)
+{
+	EscapeCommFunction(Serial_Handle, SETRTS);
+}
+
+/*
+ * Function: Serial_ClearRTS
+ * Clear the RTS Line
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_ClearRTS(HANDLE Serial_Handle)
+{
+	EscapeCommFunction(Serial_Handle, CLRRTS);
+}
+
+/*
+ * Function: Serial_ReadString
+ * Reads a string from the serial port, reporting a failed read rather than stopping.
+ * Once the buffer is full no more is read, so the rest of a long line is left for the
+ * next call rather than lost.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * Buffer - Pointer to buffer to receive the read string.
+ * BufSize - Length of the buffer for the returned string.
+ * Error - Pointer to receive the GetLastError value of a failed read, 0 if none failed.
+ * Complete - Pointer to receive non zero if the string ended at a line end, 0 if the
+ *            buffer filled, the read timed out or a read failed first.
+ *
+ * Returns:
+ * (int) - The number of characters.
+ *
+ */
+static int Serial_ReadString(HANDLE Serial_Handle, char *Buffer, int BufSize, DWORD *Error, int *Complete)
+{
+	char c = 0;
+	int charsread = 0;
+	DWORD bytesread = 0;
+	double elapsed = 0.0;
+	clock_t start;
+
+	*Error = 0;
+	*Complete = 0;
+
+	// Clear the buffer contents
+	memset(Buffer, 0, BufSize);
+
+	start = clock();
+	for (;;)
+	{
+		// Break out if the buffer is filled, before reading a char there's no room for.
+		if (charsread >= (BufSize - 1))
+			break;
+
+		elapsed = ((double)(clock() - start)) / CLOCKS_PER_SEC;
+
+		if (!Serial_Read(Serial_Handle, &c, 1, &bytesread))
+		{
+			*Error = GetLastError();
+			break;
+		}
+
+		if (bytesread != 0)
+		{
+			// Break out if a carriage return or line feed is found.
+			if (c == 10 || c == 13)
+			{
+				*Complete = 1;
+				break;
+			}
+
+			// Add the read char to the buffer
+			Buffer[charsread] = c;
+
+			// Increment the number of characters read
+			charsread++;
+		}
+
+		if (elapsed > 5)
+		{
+			break;
+		}
+	}
+	Buffer[charsread] = '\0';
+
+	return charsread;
+}
+
+/*
+ * Function: Serial_GetString
+ * Reads a string from the serial port
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * Buffer - Pointer to buffer to receive the read string.
+ * BufSize - Length of the buffer for the returned string.
+ *
+ * Returns:
+ * (int) - The number of characters.
+ *
+ */
+int Serial_GetString(HANDLE Serial_Handle, char *Buffer, int BufSize)
+{
+	DWORD error;
+	int charsread;
+	int complete;
+
+	charsread = Serial_ReadString(Serial_Handle, Buffer, BufSize, &error, &complete);
+
+	// The end of a replay isn't an error.
+	if (error != 0 && error != ERROR_HANDLE_EOF)
+	{
+		SetLastError(error);
+		Serial_ShowError("Serial_GetString");
+	}
+
+	return charsread;
+}
+
+/*
+ * Function: Serial_PortExists
+ * Checks to see if a comport exists. Uses the cached list from Serial_EnumPorts, so the
+ * port is never opened and a port in use by another process still counts as existing.
+ * Thread safe.
+ *
+ * Parameters:
+ * ComPort - Port number to check.
+ *
+ * Returns:
+ * (int) - non zero port exists.
+ *
+ */
+int Serial_PortExists(unsigned char ComPort)
+{
+	unsigned char ports[SERIAL_MAX_PORTS];
+	int count;
+	int i;
+
+	count = Serial_EnumPorts(ports, SERIAL_MAX_PORTS);
+	for (i = 0; i < count; i++)
+	{
+		if (ports[i] == ComPort)
+			return 1;
+	}
+	return 0;
+}
+
+// Port list cache used by Serial_EnumPorts
+static SRWLOCK Serial_PortLock = SRWLOCK_INIT;
+static unsigned char Serial_PortCache[SERIAL_MAX_PORTS];
+static int Serial_PortCacheCount = -1;
+static int Serial_PortNotifyPending = 0;
+static HKEY Serial_PortKey = NULL;
+static HANDLE Serial_PortEvent = NULL;
+
+/*
+ * Function: Serial_EnumPorts
+ * Lists the serial ports present on the system in one call, reading the device map
+ * HKEY_LOCAL_MACHINE\HARDWARE\DEVICEMAP\SERIALCOMM rather than opening every port.
+ * The list is cached and only read again once the registry reports that the device
+ * map has changed, which happens whenever a port is plugged in or removed.
+ * Thread safe, the cache is guarded by a lock.
+ *
+ * Parameters:
+ * Ports - Pointer to an array to receive the port numbers in ascending order.
+ * MaxPorts - Number of entries in the array.
+ *
+ * Returns:
+ * (int) - The number of ports present, which may be more than MaxPorts.
+ *
+ */
+int Serial_EnumPorts(unsigned char *Ports, int MaxPorts)
+{
+	unsigned char present[SERIAL_MAX_PORTS + 1];
+	char name[256];
+	char value[32];
+	DWORD namesize, valuesize, type;
+	DWORD index;
+	DWORD notify = REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET;
+	LSTATUS result;
+	int count;
+	int port;
+	int i;
+
+	AcquireSRWLockExclusive(&Serial_PortLock);
+
+	if (Serial_PortKey == NULL)
+	{
+		if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, "HARDWARE\\DEVICEMAP\\SERIALCOMM", 0, KEY_READ, &Serial_PortKey) != ERROR_SUCCESS)
+		{
+			// The key only exists once a port driver has loaded, so no key means no ports.
+			Serial_PortKey = NULL;
+			ReleaseSRWLockExclusive(&Serial_PortLock);
+			return 0;
+		}
+		Serial_PortEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+
+	// The event is signalled once when the device map changes, then has to be asked for again.
+	if (Serial_PortNotifyPending && WaitForSingleObject(Serial_PortEvent, 0) == WAIT_OBJECT_0)
+	{
+		Serial_PortNotifyPending = 0;
+		Serial_PortCacheCount = -1;
+	}
+
+	// Ask for the next change before reading, so one arriving during the read isn't missed.
+	// Without a pending notification the cache can't be trusted, so it is read every time.
+	if (!Serial_PortNotifyPending)
+	{
+#ifdef REG_NOTIFY_THREAD_AGNOSTIC
+		notify |= REG_NOTIFY_THREAD_AGNOSTIC;
+#endif
+		if (Serial_PortEvent != NULL && RegNotifyChangeKeyValue(Serial_PortKey, FALSE, notify, Serial_PortEvent, TRUE) == ERROR_SUCCESS)
+			Serial_PortNotifyPending = 1;
+		Serial_PortCacheCount = -1;
+	}
+
+	if (Serial_PortCacheCount < 0)
+	{
+		memset(present, 0, sizeof(present));
+		for (index = 0;; index++)
+		{
+			namesize = sizeof(name);
+			valuesize = sizeof(value) - 1;
+			result = RegEnumValue(Serial_PortKey, index, name, &namesize, NULL, &type, (BYTE *)value, &valuesize);
+
+			// A name or value too long for the buffers can't be a port, skip it.
+			if (result == ERROR_MORE_DATA)
+				continue;
+			if (result != ERROR_SUCCESS)
+				break;
+
+			// The stored value needn't be terminated, terminate it before looking at it.
+			value[valuesize] = '\0';
+			if (type != REG_SZ || _strnicmp(value, "COM", 3) != 0)
+				continue;
+
+			port = atoi(value + 3);
+			if (port > 0 && port <= SERIAL_MAX_PORTS)
+				present[port] = 1;
+		}
+
+		Serial_PortCacheCount = 0;
+		for (port = 1; port <= SERIAL_MAX_PORTS; port++)
+		{
+			if (present[port])
+				Serial_PortCache[Serial_PortCacheCount++] = (unsigned char)port;
+		}
+	}
+
+	for (i = 0; i < Serial_PortCacheCount && i < MaxPorts; i++)
+		Ports[i] = Serial_PortCache[i];
+	count = Serial_PortCacheCount;
+
+	ReleaseSRWLockExclusive(&Serial_PortLock);
+
+	return count;
+}
+
+/*
+ * Function: Serial_InvalidatePortCache
+ * Forces the next Serial_EnumPorts call to read the port list again, for example from
+ * a WM_DEVICECHANGE handler.
+ *
+ * Parameters:
+ * void.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_InvalidatePortCache(void)
+{
+	AcquireSRWLockExclusive(&Serial_PortLock);
+	Serial_PortCacheCount = -1;
+	ReleaseSRWLockExclusive(&Serial_PortLock);
+}
+
+/*
+ * Function: Serial_ReaderThread
+ * Reader thread started by Serial_StartReader. Reads lines straight into the ring slots
+ * and publishes them to the consumer.
+ *
+ * Parameters:
+ * Param - Pointer to the Serial_Ring being filled.
+ *
+ * Returns:
+ * (DWORD) - Always 0.
+ */
+static DWORD WINAPI Serial_ReaderThread(LPVOID Param)
+{
+	Serial_Ring *Ring = (Serial_Ring *)Param;
+	Serial_RingSlot Spare;
+	Serial_RingSlot *Slot;
+	DWORD error;
+	int complete;
+	LONG Head;
+	LONG Next;
+
+	while (Ring->Running)
+	{
+		Head = Ring->Head;
+		Next = (Head + 1) & (SERIAL_RING_SLOTS - 1);
+
+		// When the consumer has fallen behind keep draining the port into the spare slot,
+		// so the driver buffer never overruns while we wait.
+		if (Next == Ring->Tail)
+			Slot = &Spare;
+		else
+			Slot = &Ring->Slots[Head];
+
+		Slot->Length = Serial_ReadString(Ring->Serial_Handle, Slot->Data, SERIAL_RING_SLOT_SIZE, &error, &complete);
+		Slot->Complete = complete;
+
+		if (Slot->Length != 0 && Slot == &Spare)
+		{
+			// The consumer may have caught up while we were reading.
+			if (Next == Ring->Tail)
+			{
+				InterlockedIncrement(&Ring->Dropped);
+				Slot = NULL;
+			}
+			else
+			{
+				Ring->Slots[Head].Length = Spare.Length;
+				Ring->Slots[Head].Complete = Spare.Complete;
+				memcpy(Ring->Slots[Head].Data, Spare.Data, Spare.Length + 1);
+			}
+		}
+
+		if (Slot != NULL && Slot->Length != 0)
+		{
+			if (!Slot->Complete)
+				InterlockedIncrement(&Ring->Partial);
+
+			// Make the slot contents visible before the consumer can see the new head.
+			MemoryBarrier();
+			Ring->Head = Next;
+		}
+
+		// A failed read stops the reader, the consumer picks the error up from Serial_RingError
+		// once it has taken every line that arrived before it.
+		if (error != 0)
+		{
+			MemoryBarrier();
+			Ring->Error = error;
+			InterlockedExchange(&Ring->Running, 0);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function: Serial_StartReader
+ * Starts a thread which reads lines from the serial port into a lock-free single producer,
+ * single consumer ring. Lines are read directly into preallocated slots and handed to one
+ * consumer thread with Serial_RingBorrow and Serial_RingRelease, so slow processing no
+ * longer holds up reception. Lines cut short are still handed over, see Serial_RingComplete.
+ * A failed read stops the thread rather than the process, see Serial_RingError.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * (Serial_Ring *) - Pointer to the ring or NULL on error.
+ *
+ */
+Serial_Ring *Serial_StartReader(HANDLE Serial_Handle)
+{
+	Serial_Ring *Ring;
+
+	if (Serial_Handle == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	Ring = (Serial_Ring *)calloc(1, sizeof(Serial_Ring));
+	if (Ring == NULL)
+		return NULL;
+
+	Ring->Serial_Handle = Serial_Handle;
+	Ring->Running = 1;
+
+	Ring->Thread = CreateThread(NULL, 0, Serial_ReaderThread, Ring, 0, NULL);
+	if (Ring->Thread == NULL)
+	{
+		free(Ring);
+		return NULL;
+	}
+
+	return Ring;
+}
+
+/*
+ * Function: Serial_StopReader
+ * Stops the reader thread and frees the ring. The thread finishes its current
+ * Serial_GetString call first, so this can take up to its five second timeout.
+ * Call it after Serial_RingError reports an error too, to free the ring.
+ *
+ * Parameters:
+ * Ring - Pointer to the ring returned by Serial_StartReader.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_StopReader(Serial_Ring *Ring)
+{
+	if (Ring == NULL)
+		return;
+
+	InterlockedExchange(&Ring->Running, 0);
+	WaitForSingleObject(Ring->Thread, INFINITE);
+	CloseHandle(Ring->Thread);
+	free(Ring);
+}
+
+/*
+ * Function: Serial_RingBorrow
+ * Borrows the oldest received line from the ring without copying it. The line stays
+ * valid until it is handed back with Serial_RingRelease. Only one thread may consume
+ * from a ring.
+ *
+ * Parameters:
+ * Ring - Pointer to the ring returned by Serial_StartReader.
+ * Length - Pointer to an int to receive the length of the line, may be NULL.
+ *
+ * Returns:
+ * (char *) - Pointer to the null terminated line or NULL if the ring is empty.
+ *
+ */
+char *Serial_RingBorrow(Serial_Ring *Ring, int *Length)
+{
+	LONG Tail = Ring->Tail;
+
+	if (Tail == Ring->Head)
+		return NULL;
+
+	// Don't read the slot before we have seen the head that published it.
+	MemoryBarrier();
+
+	if (Length != NULL)
+		*Length = Ring->Slots[Tail].Length;
+
+	return Ring->Slots[Tail].Data;
+}
+
+/*
+ * Function: Serial_RingComplete
+ * Checks whether the line borrowed with Serial_RingBorrow ended at a line end. A line
+ * longer than SERIAL_RING_SLOT_SIZE - 1 characters is handed over in pieces, all but the
+ * last of them incomplete, and a line still unfinished after the 5 second read timeout
+ * is handed over as it stands.
+ *
+ * Parameters:
+ * Ring - Pointer to the ring returned by Serial_StartReader.
+ *
+ * Returns:
+ * (int) - non zero for a complete line, 0 for part of one or if the ring is empty.
+ *
+ */
+int Serial_RingComplete(Serial_Ring *Ring)
+{
+	LONG Tail = Ring->Tail;
+
+	if (Tail == Ring->Head)
+		return 0;
+
+	MemoryBarrier();
+	return Ring->Slots[Tail].Complete;
+}
+
+/*
+ * Function: Serial_RingRelease
+ * Hands the line returned by Serial_RingBorrow back to the reader thread.
+ *
+ * Parameters:
+ * Ring - Pointer to the ring returned by Serial_StartReader.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_RingRelease(Serial_Ring *Ring)
+{
+	LONG Tail = Ring->Tail;
+
+	if (Tail == Ring->Head)
+		return;
+
+	// Finish with the slot before the reader thread can reuse it.
+	MemoryBarrier();
+	Ring->Tail = (Tail + 1) & (SERIAL_RING_SLOTS - 1);
+}
+
+/*
+ * Function: Serial_RingError
+ * Checks whether the reader thread has stopped because a read failed, for example
+ * because the device was unplugged or a replay reached its end (ERROR_HANDLE_EOF).
+ * The error is only reported once every line read before it has been borrowed.
+ *
+ * Parameters:
+ * Ring - Pointer to the ring returned by Serial_StartReader.
+ *
+ * Returns:
+ * (DWORD) - The GetLastError value of the failed read, 0 while the reader is still running
+ *			or lines remain in the ring.
+ *
+ */
+DWORD Serial_RingError(Serial_Ring *Ring)
+{
+	DWORD error = Ring->Error;
+
+	// The error is set after the last head, so seeing it means the head is final.
+	MemoryBarrier();
+	if (error == 0 || Ring->Tail != Ring->Head)
+		return 0;
+
+	return error;
+}
+
+// SLIP special characters
+#define SLIP_END 0xC0
+#define SLIP_ESC 0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+
+// CRC-16/CCITT lookup table, polynomial 0x1021
+static const unsigned short Serial_CrcTable[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+	0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+	0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+	0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+	0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+	0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+	0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+	0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+	0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+	0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+	0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+	0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+	0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+	0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+	0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+	0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+	0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+	0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+	0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+	0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+	0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+	0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+/*
+ * Function: Serial_Crc16
+ * Calculates the CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF) of a block of data.
+ *
+ * Parameters:
+ * Data - Pointer to the data.
+ * Length - Number of bytes of data.
+ *
+ * Returns:
+ * (unsigned short) - The CRC.
+ *
+ */
+static unsigned short Serial_Crc16(const unsigned char *Data, int Length)
+{
+	unsigned short crc = 0xFFFF;
+	int i;
+
+	for (i = 0; i < Length; i++)
+		crc = (unsigned short)((crc << 8) ^ Serial_CrcTable[((crc >> 8) ^ Data[i]) & 0xFF]);
+
+	return crc;
+}
+
+/*
+ * Function: Serial_CobsDecode
+ * Decodes a COBS frame in place. The decoded data starts one byte into the frame, so
+ * nothing needs moving unless the frame holds a run of 254 or more non zero bytes.
+ *
+ * Parameters:
+ * Data - Pointer to the encoded frame, without its 0x00 delimiter.
+ * Length - Length of the encoded frame.
+ *
+ * Returns:
+ * (int) - Length of the decoded data at Data + 1, or -1 if the frame is badly encoded.
+ *
+ */
+static int Serial_CobsDecode(unsigned char *Data, int Length)
+{
+	int in = 0;
+	int out = 1;
+	int code = Data[0];
+	int next;
+
+	for (;;)
+	{
+		if (code == 0 || in + code > Length)
+			return -1;
+
+		// Only a previous 0xFF block leaves a gap to close up.
+		if (out != in + 1)
+			memmove(Data + out, Data + in + 1, code - 1);
+
+		out += code - 1;
+		in += code;
+		if (in >= Length)
+			break;
+
+		// Read the next code before it is overwritten by the zero it stands for.
+		next = Data[in];
+		if (code != 0xFF)
+			Data[out++] = 0;
+		code = next;
+	}
+
+	return out - 1;
+}
+
+/*
+ * Function: Serial_SlipDecode
+ * Decodes a SLIP frame in place. Runs of data between escapes are moved as blocks,
+ * frames without escapes are left untouched.
+ *
+ * Parameters:
+ * Data - Pointer to the encoded frame, without its END delimiter.
+ * Length - Length of the encoded frame.
+ *
+ * Returns:
+ * (int) - Length of the decoded data at Data, or -1 if the frame is badly encoded.
+ *
+ */
+static int Serial_SlipDecode(unsigned char *Data, int Length)
+{
+	unsigned char *esc;
+	int in = 0;
+	int out = 0;
+	int run;
+
+	while (in < Length)
+	{
+		esc = (unsigned char *)memchr(Data + in, SLIP_ESC, Length - in);
+		run = (esc != NULL ? (int)(esc - Data) : Length) - in;
+
+		if (out != in)
+			memmove(Data + out, Data + in, run);
+		out += run;
+		in += run;
+
+		if (in >= Length)
+			break;
+
+		if (in + 1 >= Length)
+			return -1;
+
+		if (Data[in + 1] == SLIP_ESC_END)
+			Data[out++] = SLIP_END;
+		else if (Data[in + 1] == SLIP_ESC_ESC)
+			Data[out++] = SLIP_ESC;
+		else
+			return -1;
+		in += 2;
+	}
+
+	return out;
+}
+
+/*
+ * Function: Serial_FramerInit
+ * Prepares a framer for use with Serial_GetFrame.
+ *
+ * Parameters:
+ * Framer - Pointer to the framer.
+ * Mode - SERIAL_FRAME_COBS, SERIAL_FRAME_SLIP or SERIAL_FRAME_LENGTH_CRC.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_FramerInit(Serial_Framer *Framer, int Mode)
+{
+	Framer->Mode = Mode;
+	Framer->Start = 0;
+	Framer->End = 0;
+	Framer->Scan = 0;
+	Framer->Frames = 0;
+	Framer->FramingErrors = 0;
+	Framer->CrcErrors = 0;
+}
+
+/*
+ * Function: Serial_FramerNext
+ * Decodes the next complete frame already held in the framer buffer. Frames are decoded
+ * in place and returned as a pointer into the buffer, which stays valid until the next
+ * call to Serial_FramerNext or Serial_GetFrame. Bad frames are skipped and counted in
+ * FramingErrors or CrcErrors, empty frames are skipped.
+ *
+ * Parameters:
+ * Framer - Pointer to the framer.
+ * Frame - Pointer to receive the address of the decoded frame.
+ *
+ * Returns:
+ * (int) - Length of the frame, 0 if no complete frame is buffered.
+ *
+ */
+int Serial_FramerNext(Serial_Framer *Framer, unsigned char **Frame)
+{
+	unsigned char *data;
+	unsigned char *delimiter;
+	int length;
+
+	if (Framer->Mode == SERIAL_FRAME_LENGTH_CRC)
+	{
+		while (Framer->End - Framer->Start >= 2)
+		{
+			data = Framer->Buffer + Framer->Start;
+			length = data[0] | (data[1] << 8);
+
+			// A length that can never fit means we are out of step, resync a byte later.
+			if (length + 4 > SERIAL_FRAME_BUFFER_SIZE)
+			{
+				Framer->FramingErrors++;
+				Framer->Start++;
+				continue;
+			}
+
+			if (Framer->End - Framer->Start < length + 4)
+				return 0;
+
+			if (Serial_Crc16(data, length + 2) != (data[length + 2] | (data[length + 3] << 8)))
+			{
+				Framer->CrcErrors++;
+				Framer->Start++;
+				continue;
+			}
+
+			Framer->Start += length + 4;
+			if (length == 0)
+				continue;
+
+			Framer->Frames++;
+			*Frame = data + 2;
+			return length;
+		}
+		return 0;
+	}
+
+	for (;;)
+	{
+		delimiter = (unsigned char *)memchr(Framer->Buffer + Framer->Scan, Framer->Mode == SERIAL_FRAME_SLIP ? SLIP_END : 0x00, Framer->End - Framer->Scan);
+		if (delimiter == NULL)
+		{
+			Framer->Scan = Framer->End;
+			return 0;
+		}
+
+		data = Framer->Buffer + Framer->Start;
+		length = (int)(delimiter - data);
+		Framer->Start = Framer->Scan = (int)(delimiter - Framer->Buffer) + 1;
+
+		if (length == 0)
+			continue;
+
+		if (Framer->Mode == SERIAL_FRAME_SLIP)
+		{
+			length = Serial_SlipDecode(data, length);
+		}
+		else
+		{
+			length = Serial_CobsDecode(data, length);
+			data++;
+		}
+
+		if (length < 0)
+		{
+			Framer->FramingErrors++;
+			continue;
+		}
+
+		if (length == 0)
+			continue;
+
+		Framer->Frames++;
+		*Frame = data;
+		return length;
+	}
+}
+
+/*
+ * Function: Serial_ReadFrame
+ * Reads a binary frame from the serial port, reporting a failed read rather than stopping.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * Framer - Pointer to a framer set up with Serial_FramerInit.
+ * Frame - Pointer to receive the address of the decoded frame.
+ * Error - Pointer to receive the GetLastError value of a failed read, 0 if none failed.
+ *
+ * Returns:
+ * (int) - Length of the frame, 0 if no complete frame arrived before the read timed out.
+ *
+ */
+static int Serial_ReadFrame(HANDLE Serial_Handle, Serial_Framer *Framer, unsigned char **Frame, DWORD *Error)
+{
+	DWORD bytesread = 0;
+	int length;
+
+	*Error = 0;
+
+	length = Serial_FramerNext(Framer, Frame);
+	if (length != 0)
+		return length;
+
+	// Make room at the end of the buffer, only a partial frame ever needs moving.
+	if (Framer->Start == Framer->End)
+	{
+		Framer->Start = Framer->End = Framer->Scan = 0;
+	}
+	else if (Framer->End == SERIAL_FRAME_BUFFER_SIZE)
+	{
+		if (Framer->Start == 0)
+		{
+			// The buffer is full without a delimiter, throw it away.
+			Framer->FramingErrors++;
+			Framer->Start = Framer->End = Framer->Scan = 0;
+		}
+		else
+		{
+			memmove(Framer->Buffer, Framer->Buffer + Framer->Start, Framer->End - Framer->Start);
+			Framer->End -= Framer->Start;
+			Framer->Scan -= Framer->Start;
+			Framer->Start = 0;
+		}
+	}
+
+	if (!Serial_Read(Serial_Handle, Framer->Buffer + Framer->End, SERIAL_FRAME_BUFFER_SIZE - Framer->End, &bytesread))
+	{
+		*Error = GetLastError();
+		return 0;
+	}
+	Framer->End += bytesread;
+
+	return Serial_FramerNext(Framer, Frame);
+}
+
+/*
+ * Function: Serial_GetFrame
+ * Reads a binary frame from the serial port. Data is read in blocks straight into the
+ * framer buffer and decoded there, see Serial_FramerNext.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * Framer - Pointer to a framer set up with Serial_FramerInit.
+ * Frame - Pointer to receive the address of the decoded frame.
+ *
+ * Returns:
+ * (int) - Length of the frame, 0 if no complete frame arrived before the read timed out.
+ *
+ */
+int Serial_GetFrame(HANDLE Serial_Handle, Serial_Framer *Framer, unsigned char **Frame)
+{
+	DWORD error;
+	int length;
+
+	length = Serial_ReadFrame(Serial_Handle, Framer, Frame, &error);
+
+	// The end of a replay isn't an error.
+	if (error != 0 && error != ERROR_HANDLE_EOF)
+	{
+		SetLastError(error);
+		Serial_ShowError("Serial_GetFrame");
+	}
+
+	return length;
+}
+
+/*
+ * Function: Serial_PutFrame
+ * Encodes a block of data as a binary frame and sends it to the serial port.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * Mode - SERIAL_FRAME_COBS, SERIAL_FRAME_SLIP or SERIAL_FRAME_LENGTH_CRC.
+ * Data - Pointer to the data to send.
+ * Length - Number of bytes of data.
+ *
+ * Returns:
+ * (int) - Number of bytes written, 0 if the encoded frame would not fit in SERIAL_FRAME_BUFFER_SIZE.
+ *
+ */
+int Serial_PutFrame(HANDLE Serial_Handle, int Mode, const unsigned char *Data, int Length)
+{
+	unsigned char frame[SERIAL_FRAME_BUFFER_SIZE];
+	unsigned short crc;
+	DWORD cnt = 0;
+	int code_pos, code;
+	int out = 0;
+	int i;
+
+	if (Mode == SERIAL_FRAME_COBS)
+	{
+		if (Length + Length / 254 + 2 > SERIAL_FRAME_BUFFER_SIZE)
+			return 0;
+
+		code_pos = out++;
+		code = 1;
+		for (i = 0; i < Length; i++)
+		{
+			if (Data[i] != 0)
+			{
+				frame[out++] = Data[i];
+				code++;
+			}
+
+			if (Data[i] == 0 || code == 0xFF)
+			{
+				frame[code_pos] = (unsigned char)code;
+				code_pos = out++;
+				code = 1;
+			}
+		}
+		frame[code_pos] = (unsigned char)code;
+		frame[out++] = 0x00;
+	}
+	else if (Mode == SERIAL_FRAME_SLIP)
+	{
+		if (Length * 2 + 2 > SERIAL_FRAME_BUFFER_SIZE)
+			return 0;
+
+		frame[out++] = SLIP_END;
+		for (i = 0; i < Length; i++)
+		{
+			if (Data[i] == SLIP_END)
+			{
+				frame[out++] = SLIP_ESC;
+				frame[out++] = SLIP_ESC_END;
+			}
+			else if (Data[i] == SLIP_ESC)
+			{
+				frame[out++] = SLIP_ESC;
+				frame[out++] = SLIP_ESC_ESC;
+			}
+			else
+			{
+				frame[out++] = Data[i];
+			}
+		}
+		frame[out++] = SLIP_END;
+	}
+	else
+	{
+		if (Length + 4 > SERIAL_FRAME_BUFFER_SIZE)
+			return 0;
+
+		frame[out++] = (unsigned char)(Length & 0xFF);
+		frame[out++] = (unsigned char)(Length >> 8);
+		memcpy(frame + out, Data, Length);
+		out += Length;
+		crc = Serial_Crc16(frame, out);
+		frame[out++] = (unsigned char)(crc & 0xFF);
+		frame[out++] = (unsigned char)(crc >> 8);
+	}
+
+	Serial_Write(Serial_Handle, frame, out, &cnt);
+	return cnt;
+}
+
+/*
+ * Function: Serial_AttachHandle
+ * Starts keeping statistics for a handle. Serial_OpenPort does this itself, call it for
+ * handles opened some other way.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * (int) - non zero on success, 0 if the handle is invalid or SERIAL_MAX_OPEN_PORTS
+ * handles are already attached.
+ *
+ */
+int Serial_AttachHandle(HANDLE Serial_Handle)
+{
+	LONG used;
+	LONG i;
+
+	if (Serial_Handle == NULL || Serial_Handle == INVALID_HANDLE_VALUE)
+		return 0;
+
+	if (Serial_FindPort(Serial_Handle) != NULL)
+		return 1;
+
+	if (Serial_TimerFrequency.QuadPart == 0)
+		QueryPerformanceFrequency(&Serial_TimerFrequency);
+
+	for (i = 0; i < SERIAL_MAX_OPEN_PORTS; i++)
+	{
+		if (InterlockedCompareExchangePointer((PVOID volatile *)&Serial_PortTable[i].Handle, Serial_Handle, NULL) == NULL)
+		{
+			memset(&Serial_PortTable[i].Stats, 0, sizeof(Serial_Stats));
+			Serial_PortTable[i].Capture = NULL;
+			Serial_PortTable[i].Replay = NULL;
+
+			// Make sure Serial_FindPort searches far enough to see the new entry.
+			do
+			{
+				used = Serial_PortTableUsed;
+				if (used > i)
+					break;
+			} while (InterlockedCompareExchange(&Serial_PortTableUsed, i + 1, used) != used);
+
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function: Serial_DetachHandle
+ * Stops keeping statistics for a handle, stopping any capture and releasing the log of
+ * a replay. The handle itself is left open. Serial_ClosePort does this itself.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_DetachHandle(HANDLE Serial_Handle)
+{
+	Serial_PortState *port = Serial_FindPort(Serial_Handle);
+	Serial_Replay *replay;
+
+	if (port == NULL)
+		return;
+
+	Serial_StopCapture(Serial_Handle);
+
+	replay = port->Replay;
+	if (replay != NULL)
+	{
+		port->Replay = NULL;
+		UnmapViewOfFile(replay->Records - sizeof(Serial_LogHeader));
+		CloseHandle(replay->Mapping);
+		free(replay);
+	}
+
+	InterlockedExchangePointer((PVOID volatile *)&port->Handle, NULL);
+}
+
+/*
+ * Function: Serial_GetStats
+ * Takes a snapshot of the statistics for a port. Communication errors reported by the
+ * driver are collected first, counters are updated without locking so the snapshot
+ * can be taken from any thread.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ * Stats - Pointer to a Serial_Stats to receive the snapshot.
+ *
+ * Returns:
+ * (int) - non zero on success, 0 if no statistics are kept for the handle.
+ *
+ */
+int Serial_GetStats(HANDLE Serial_Handle, Serial_Stats *Stats)
+{
+	Serial_PortState *port = Serial_FindPort(Serial_Handle);
+	volatile LONG64 *src;
+	LONG64 *dst;
+	size_t i;
+
+	memset(Stats, 0, sizeof(Serial_Stats));
+	if (port == NULL)
+		return 0;
+
+	Serial_PollErrors(Serial_Handle, port);
+
+	// Read each counter atomically, a plain 64 bit read can tear on 32 bit builds.
+	src = (volatile LONG64 *)&port->Stats;
+	dst = (LONG64 *)Stats;
+	for (i = 0; i < sizeof(Serial_Stats) / sizeof(LONG64); i++)
+		dst[i] = InterlockedCompareExchange64(&src[i], 0, 0);
+
+	return 1;
+}
+
+/*
+ * Function: Serial_ResetStats
+ * Sets all of the statistics for a port back to zero.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * void.
+ */
+void Serial_ResetStats(HANDLE Serial_Handle)
+{
+	Serial_PortState *port = Serial_FindPort(Serial_Handle);
+	volatile LONG64 *counter;
+	size_t i;
+
+	if (port == NULL)
+		return;
+
+	counter = (volatile LONG64 *)&port->Stats;
+	for (i = 0; i < sizeof(Serial_Stats) / sizeof(LONG64); i++)
+		InterlockedExchange64(&counter[i], 0);
+}
+
+/*
+ * Function: Serial_StartCapture
+ * Starts capturing everything read from and written to a port into a memory mapped,
+ * append only log. Each chunk is stored with the time it was read or written, so the
+ * log can later be played back with Serial_OpenReplay. The log is a fixed size, chunks
+ * which don't fit are dropped.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port, opened with Serial_OpenPort or attached.
+ * FileName - Name of the log file to create.
+ * MaxSize - Size of the log file in bytes.
+ *
+ * Returns:
+ * (int) - non zero on success.
+ *
+ */
+int Serial_StartCapture(HANDLE Serial_Handle, const char *FileName, DWORD MaxSize)
+{
+	Serial_PortState *port = Serial_FindPort(Serial_Handle);
+	Serial_Capture *capture;
+	LARGE_INTEGER now;
+	FILETIME started;
+	DCB dcb;
+
+	if (port == NULL || port->Capture != NULL || MaxSize <= sizeof(Serial_LogHeader))
+		return 0;
+
+	capture = (Serial_Capture *)calloc(1, sizeof(Serial_Capture));
+	if (capture == NULL)
+		return 0;
+
+	capture->File = CreateFile(FileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (capture->File == INVALID_HANDLE_VALUE)
+	{
+		free(capture);
+		return 0;
+	}
+
+	// Mapping the file at its full size extends it, the pages are zero until written.
+	capture->Mapping = CreateFileMapping(capture->File, NULL, PAGE_READWRITE, 0, MaxSize, NULL);
+	if (capture->Mapping != NULL)
+		capture->Header = (Serial_LogHeader *)MapViewOfFile(capture->Mapping, FILE_MAP_WRITE, 0, 0, MaxSize);
+
+	if (capture->Header == NULL)
+	{
+		if (capture->Mapping != NULL)
+			CloseHandle(capture->Mapping);
+		CloseHandle(capture->File);
+		DeleteFile(FileName);
+		free(capture);
+		return 0;
+	}
+
+	GetSystemTimeAsFileTime(&started);
+	memcpy(capture->Header->Magic, SERIAL_LOG_MAGIC, sizeof(capture->Header->Magic));
+	capture->Header->StartTime = ((LONG64)started.dwHighDateTime << 32) | started.dwLowDateTime;
+	capture->Capacity = MaxSize - sizeof(Serial_LogHeader);
+	capture->LastDirection = SERIAL_CAPTURE_NONE;
+
+	// Chunks of a stream arrive a character time or so apart, 10 bits per character.
+	capture->MergeGap = SERIAL_CAPTURE_MERGE_GAP;
+	if (GetCommState(Serial_Handle, &dcb) && dcb.BaudRate != 0 && SERIAL_CAPTURE_MERGE_CHARS * 10000000LL / (LONG64)dcb.BaudRate > capture->MergeGap)
+		capture->MergeGap = SERIAL_CAPTURE_MERGE_CHARS * 10000000LL / (LONG64)dcb.BaudRate;
+
+	QueryPerformanceCounter(&now);
+	capture->Start = now.QuadPart;
+
+	InterlockedExchangePointer((PVOID volatile *)&port->Capture, capture);
+
+	return 1;
+}
+
+/*
+ * Function: Serial_StopCapture
+ * Stops capturing a port and trims the log to the data written. The number of chunks
+ * which didn't fit is returned and kept in the log header, a non zero count means the
+ * log is missing data. Don't call it while another thread is still reading or writing
+ * the port. Serial_ClosePort does this itself.
+ *
+ * Parameters:
+ * Serial_Handle - Handle to the serial port.
+ *
+ * Returns:
+ * (int) - The number of chunks dropped, 0 if the port wasn't being captured.
+ *
+ */
+int Serial_StopCapture(HANDLE Serial_Handle)
+{
+	Serial_PortState *port = Serial_FindPort(Serial_Handle);
+	Serial_Capture *capture;
+	Serial_LogRecord *record;
+	unsigned char *records;
+	LARGE_INTEGER end;
+	LONG64 used = 0;
+	int dropped;
+
+	if (port == NULL || port->Capture == NULL)
+		return 0;
 
-		// Hardware flow control
-		dcbCommPort.fOutxCtsFlow = FALSE;
-		dcbCommPort.fOutxDsrFlow = FALSE;
-	}
+	capture = (Serial_Capture *)InterlockedExchangePointer((PVOID volatile *)&port->Capture, NULL);
 
-	if (!SetCommState(Serial_Handle, &dcbCommPort))
+	// Reservations are handed out in order, so the data ends at the first empty record.
+	records = (unsigned char *)(capture->Header + 1);
+	while (used + (LONG64)sizeof(Serial_LogRecord) <= capture->Capacity)
 	{
-		CloseHandle(Serial_Handle);
-		return INVALID_HANDLE_VALUE;
+		record = (Serial_LogRecord *)(records + used);
+		if (record->Size == 0)
+			break;
+		used += record->Size;
 	}
 
-	return Serial_Handle;
+	dropped = capture->Dropped;
+	capture->Header->Used = used;
+	capture->Header->Dropped = dropped;
+	UnmapViewOfFile(capture->Header);
+	CloseHandle(capture->Mapping);
+
+	end.QuadPart = sizeof(Serial_LogHeader) + used;
+	SetFilePointerEx(capture->File, end, NULL, FILE_BEGIN);
+	SetEndOfFile(capture->File);
+	CloseHandle(capture->File);
+
+	free(capture);
+
+	return dropped;
 }
 
 /*
- * Function: Serial_ClosePort
- * Closes a serial port opened with the OpenPort function.
+ * Function: Serial_OpenReplay
+ * Opens a capture log as a replay source. The returned handle works with Serial_GetByte,
+ * Serial_GetString and Serial_GetFrame, which return the received data from the log,
+ * either at the recorded timing or as fast as it can be read. Writes are discarded.
+ * Close it with Serial_ClosePort.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port
+ * FileName - Name of the log file written by Serial_StartCapture.
+ * Realtime - non zero to replay at the recorded timing.
  *
  * Returns:
- * void.
+ * Returns HANDLE or INVALID_HANDLE_VALUE on error.
+ *
  */
-void Serial_ClosePort(HANDLE Serial_Handle)
+HANDLE Serial_OpenReplay(const char *FileName, int Realtime)
 {
-	PurgeComm(Serial_Handle, PURGE_TXCLEAR | PURGE_RXCLEAR);
-	CloseHandle(Serial_Handle);
+	const Serial_LogHeader *header = NULL;
+	Serial_Replay *replay;
+	Serial_PortState *port;
+	LARGE_INTEGER filesize;
+	HANDLE file;
 
-	Serial_Handle = INVALID_HANDLE_VALUE;
+	replay = (Serial_Replay *)calloc(1, sizeof(Serial_Replay));
+	if (replay == NULL)
+		return INVALID_HANDLE_VALUE;
+
+	file = CreateFile(FileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		free(replay);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	if (GetFileSizeEx(file, &filesize) && filesize.QuadPart >= (LONGLONG)sizeof(Serial_LogHeader))
+	{
+		replay->Mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (replay->Mapping != NULL)
+			header = (const Serial_LogHeader *)MapViewOfFile(replay->Mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+
+	if (header == NULL || memcmp(header->Magic, SERIAL_LOG_MAGIC, sizeof(header->Magic)) != 0 || !Serial_AttachHandle(file))
+	{
+		if (header != NULL)
+			UnmapViewOfFile(header);
+		if (replay->Mapping != NULL)
+			CloseHandle(replay->Mapping);
+		CloseHandle(file);
+		free(replay);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	// A capture that was never stopped has no length, it ends at the first empty record.
+	replay->Records = (const unsigned char *)(header + 1);
+	replay->Size = filesize.QuadPart - sizeof(Serial_LogHeader);
+	if (header->Used != 0 && header->Used < replay->Size)
+		replay->Size = header->Used;
+	replay->Realtime = Realtime;
+
+	port = Serial_FindPort(file);
+	port->Replay = replay;
+
+	return file;
 }
 
 /*
- * Function: Serial_PutByte
- * Places a string in the serial output buffer
+ * Function: Serial_ReplayFinished
+ * Checks whether all of the received data in a replay has been read.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
- * c - Character to place in the serial output buffer.
+ * Serial_Handle - Handle returned by Serial_OpenReplay.
  *
  * Returns:
- * void.
+ * (int) - non zero at the end of the replay, or if the handle isn't a replay.
+ *
  */
-void Serial_PutByte(HANDLE Serial_Handle, unsigned char c)
+int Serial_ReplayFinished(HANDLE Serial_Handle)
 {
-	DWORD cnt;
-	WriteFile(Serial_Handle, &c, 1, &cnt, NULL);
+	Serial_PortState *port = Serial_FindPort(Serial_Handle);
+
+	if (port == NULL || port->Replay == NULL)
+		return 1;
+
+	return Serial_ReplayRecord(port->Replay) == NULL;
 }
 
 /*
- * Function: Serial_PutString
- * Places a string in the serial output buffer.
+ * Function: Serial_PortFail
+ * Records a failed read or write on a port. A device that has gone away, such as an
+ * unplugged USB adapter, gets its handle closed so Serial_PortReopen can start clean.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
- * c - Pointer to string to send to the serial port.
+ * Port - Pointer to the port.
+ * Error - GetLastError value of the failure.
  *
  * Returns:
- * void.
+ * (int) - The SERIAL_ERROR_ code.
+ *
  */
-void Serial_PutString(HANDLE Serial_Handle, char *cstring)
+static int Serial_PortFail(Serial_Port *Port, DWORD Error)
 {
-	DWORD cnt;
-	WriteFile(Serial_Handle, cstring, strlen(cstring), &cnt, NULL);
+	Port->SystemError = Error;
+
+	switch (Error)
+	{
+	case ERROR_HANDLE_EOF:
+		Port->LastError = SERIAL_ERROR_EOF;
+		break;
+
+	// Cancelled or aborted I/O leaves the port usable, it hasn't gone away.
+	case ERROR_OPERATION_ABORTED:
+		Port->LastError = SERIAL_ERROR_IO;
+		break;
+
+	case ERROR_ACCESS_DENIED:
+	case ERROR_INVALID_HANDLE:
+	case ERROR_BAD_COMMAND:
+	case ERROR_GEN_FAILURE:
+	case ERROR_DEVICE_NOT_CONNECTED:
+		Serial_PortClose(Port);
+		Port->LastError = SERIAL_ERROR_DISCONNECTED;
+		break;
+
+	default:
+		Port->LastError = SERIAL_ERROR_IO;
+		break;
+	}
+
+	return Port->LastError;
 }
 
 /*
- * Function: Serial_GetByte
- * Reads a character from the serial port
+ * Function: Serial_PortInit
+ * Prepares a port context, allocating its receive and transmit buffers. The buffers are
+ * kept for the life of the context, across any number of opens and reopens.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
- * c - Pointer to unsigned char to receive the read character
+ * Port - Pointer to the port.
+ * RxSize - Size of the receive buffer, the longest string Serial_PortGetString returns plus one.
+ * TxSize - Size of the transmit buffer, the longest string Serial_PortPrintf sends plus one.
  *
  * Returns:
- * (int ) - 0 = Nothing read
- *			1 = Byte read
+ * (int) - SERIAL_OK or SERIAL_ERROR_NO_MEMORY.
  *
  */
-int Serial_GetByte(HANDLE Serial_Handle, unsigned char *c)
+int Serial_PortInit(Serial_Port *Port, int RxSize, int TxSize)
 {
-	DWORD bytesread = 0;
-	if (ReadFile(Serial_Handle, c, 1, &bytesread, NULL) == 0)
+	memset(Port, 0, sizeof(Serial_Port));
+	Port->Handle = INVALID_HANDLE_VALUE;
+
+	if (RxSize > 1 && TxSize > 1)
 	{
-		Serial_ShowError("Serial_GetByte");
+		Port->RxSize = RxSize;
+		Port->TxSize = TxSize;
+		Port->RxBuffer = (char *)malloc(RxSize);
+		Port->TxBuffer = (char *)malloc(TxSize);
 	}
-	return bytesread;
+
+	if (Port->RxBuffer == NULL || Port->TxBuffer == NULL)
+	{
+		Serial_PortFree(Port);
+		Port->LastError = SERIAL_ERROR_NO_MEMORY;
+		return SERIAL_ERROR_NO_MEMORY;
+	}
+
+	return SERIAL_OK;
 }
 
 /*
- * Function: Serial_Flush
- * Clears the serial input and output buffers
+ * Function: Serial_PortFree
+ * Closes a port context and frees its buffers.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port
+ * Port - Pointer to the port.
  *
  * Returns:
  * void.
  */
-void Serial_Flush(HANDLE Serial_Handle)
+void Serial_PortFree(Serial_Port *Port)
 {
-	PurgeComm(Serial_Handle, PURGE_RXCLEAR | PURGE_TXCLEAR);
+	Serial_PortClose(Port);
+
+	free(Port->RxBuffer);
+	free(Port->TxBuffer);
+	Port->RxBuffer = NULL;
+	Port->TxBuffer = NULL;
+	Port->RxSize = 0;
+	Port->TxSize = 0;
 }
 
 /*
- * Function: Serial_FlushRX
- * Clears the serial input buffer
+ * Function: Serial_PortConnect
+ * Opens the port held by a context with its saved settings, closing it first if open.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port
+ * Port - Pointer to the port.
  *
  * Returns:
- * void.
+ * (int) - SERIAL_OK or SERIAL_ERROR_OPEN.
+ *
  */
-void Serial_FlushRX(HANDLE Serial_Handle)
+static int Serial_PortConnect(Serial_Port *Port)
 {
-	PurgeComm(Serial_Handle, PURGE_RXCLEAR);
+	Serial_PortClose(Port);
+
+	Port->Handle = Serial_Open(Port->ComPort, Port->BaudRate, Port->Databits, Port->Parity, Port->Stopbits, Port->Handshake, Port->Profile, FALSE, &Port->SystemError);
+	if (Port->Handle == INVALID_HANDLE_VALUE)
+	{
+		Port->LastError = SERIAL_ERROR_OPEN;
+		return SERIAL_ERROR_OPEN;
+	}
+
+	Port->LastError = SERIAL_OK;
+	return SERIAL_OK;
 }
 
 /*
- * Function: Serial_FlushTX
- * Clears the serial transmit buffer
+ * Function: Serial_PortOpen
+ * Opens a serial port into a context, remembering the settings for Serial_PortReopen.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
+ * Port - Pointer to a port set up with Serial_PortInit.
+ * nComPort - Serial port to open 1 - 255.
+ * nBaudRate - Baud rate for the serial port.
+ * nDatabits - Number of data bits.
+ * nParity - Parity to use.
+ * nStopbits - Number of stop bits.
+ * nHandshake - Type of handshaking to use.
+ * nProfile - SERIAL_PROFILE_DEFAULT, SERIAL_PROFILE_LOW_LATENCY or SERIAL_PROFILE_THROUGHPUT.
  *
  * Returns:
- * void.
+ * (int) - SERIAL_OK or SERIAL_ERROR_OPEN.
+ *
  */
-void Serial_FlushTX(HANDLE Serial_Handle)
+int Serial_PortOpen(Serial_Port *Port, unsigned char nComPort, DWORD nBaudRate, unsigned char nDatabits, unsigned char nParity, unsigned char nStopbits, unsigned char nHandshake, int nProfile)
 {
-	PurgeComm(Serial_Handle, PURGE_TXCLEAR);
+	Port->ComPort = nComPort;
+	Port->BaudRate = nBaudRate;
+	Port->Databits = nDatabits;
+	Port->Parity = nParity;
+	Port->Stopbits = nStopbits;
+	Port->Handshake = nHandshake;
+	Port->Profile = nProfile;
+
+	return Serial_PortConnect(Port);
 }
 
 /*
- * Function: Serial_Break
- * Put the serial port into a break state
+ * Function: Serial_PortReopen
+ * Closes the port if it is open and opens it again with the same settings, keeping the
+ * context and its buffers. Use it to recover after SERIAL_ERROR_DISCONNECTED.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
+ * Port - Pointer to the port.
  *
  * Returns:
- * void.
+ * (int) - SERIAL_OK or SERIAL_ERROR_OPEN.
+ *
  */
-void Serial_Break(HANDLE Serial_Handle)
+int Serial_PortReopen(Serial_Port *Port)
 {
-	SetCommBreak(Serial_Handle);
+	if (Serial_PortConnect(Port) != SERIAL_OK)
+		return Port->LastError;
+
+	Port->Reconnects++;
+	return SERIAL_OK;
 }
 
 /*
- * Function: Serial_ClearBreak
- * Clear the serial break state
+ * Function: Serial_PortOpenReplay
+ * Opens a capture log into a context in place of a port, see Serial_OpenReplay. Reads
+ * return SERIAL_ERROR_EOF once all of the received data has been read. A replay can't
+ * be reopened with Serial_PortReopen.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
+ * Port - Pointer to a port set up with Serial_PortInit.
+ * FileName - Name of the log file written by Serial_StartCapture.
+ * Realtime - non zero to replay at the recorded timing.
  *
  * Returns:
- * void.
+ * (int) - SERIAL_OK or SERIAL_ERROR_OPEN.
+ *
  */
-void Serial_ClearBreak(HANDLE Serial_Handle)
+int Serial_PortOpenReplay(Serial_Port *Port, const char *FileName, int Realtime)
 {
-	ClearCommBreak(Serial_Handle);
+	Serial_PortClose(Port);
+	Port->ComPort = 0;
+
+	Port->Handle = Serial_OpenReplay(FileName, Realtime);
+	if (Port->Handle == INVALID_HANDLE_VALUE)
+	{
+		Port->SystemError = GetLastError();
+		Port->LastError = SERIAL_ERROR_OPEN;
+		return SERIAL_ERROR_OPEN;
+	}
+
+	Port->SystemError = 0;
+	Port->LastError = SERIAL_OK;
+	return SERIAL_OK;
 }
 
 /*
- * Function: Serial_ClearDTR
- * Clear the DTR Line
+ * Function: Serial_PortClose
+ * Closes the port held by a context, leaving its buffers and settings for a reopen.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
+ * Port - Pointer to the port.
  *
  * Returns:
  * void.
  */
-void Serial_ClearDTR(HANDLE Serial_Handle)
+void Serial_PortClose(Serial_Port *Port)
 {
-	EscapeCommFunction(Serial_Handle, CLRDTR);
+	if (Port->Handle == INVALID_HANDLE_VALUE)
+		return;
+
+	Serial_ClosePort(Port->Handle);
+	Port->Handle = INVALID_HANDLE_VALUE;
 }
 
 /*
- * Function: Serial_SetDTR
- * Set the DTR Line
+ * Function: Serial_PortSetProfile
+ * Changes the profile of a port, see Serial_SetProfile. The profile is kept for reopens.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
+ * Port - Pointer to the port.
+ * nProfile - SERIAL_PROFILE_DEFAULT, SERIAL_PROFILE_LOW_LATENCY or SERIAL_PROFILE_THROUGHPUT.
  *
  * Returns:
- * void.
+ * (int) - SERIAL_OK or a SERIAL_ERROR_ code.
+ *
  */
-void Serial_SetDTR(HANDLE Serial_Handle)
+int Serial_PortSetProfile(Serial_Port *Port, int nProfile)
 {
-	EscapeCommFunction(Serial_Handle, SETDTR);
+	Port->Profile = nProfile;
+
+	if (Port->Handle == INVALID_HANDLE_VALUE)
+		return SERIAL_OK;
+
+	if (!Serial_SetProfile(Port->Handle, nProfile))
+		return Serial_PortFail(Port, GetLastError());
+
+	return SERIAL_OK;
 }
 
 /*
- * Function: Serial_SetRTS
- * Set the RTS Line
+ * Function: Serial_PortGetByte
+ * Reads a character from a port.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
+ * Port - Pointer to the port.
+ * c - Pointer to unsigned char to receive the read character.
  *
  * Returns:
- * void.
+ * (int) - 1 byte read, 0 nothing read, or a SERIAL_ERROR_ code.
+ *
  */
-void Serial_SetRTS(HANDLE Serial_Handle)
+int Serial_PortGetByte(Serial_Port *Port, unsigned char *c)
 {
-	EscapeCommFunction(Serial_Handle, SETRTS);
+	DWORD bytesread = 0;
+
+	if (Port->Handle == INVALID_HANDLE_VALUE)
+		return SERIAL_ERROR_NOT_OPEN;
+
+	if (!Serial_Read(Port->Handle, c, 1, &bytesread))
+		return Serial_PortFail(Port, GetLastError());
+
+	return bytesread;
 }
 
 /*
- * Function: Serial_ClearRTS
- * Clear the RTS Line
+ * Function: Serial_PortGetString
+ * Reads a string from a port into its receive buffer, see Serial_GetString. The string
+ * stays valid until the next call. If a read fails after part of a string has arrived,
+ * the part is returned and the failure is left in LastError and SystemError.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
+ * Port - Pointer to the port.
+ * String - Pointer to receive the address of the string.
  *
  * Returns:
- * void.
+ * (int) - The number of characters, or a SERIAL_ERROR_ code.
+ *
  */
-void Serial_ClearRTS(HANDLE Serial_Handle)
+int Serial_PortGetString(Serial_Port *Port, char **String)
 {
-	EscapeCommFunction(Serial_Handle, CLRRTS);
+	DWORD error;
+	int charsread;
+	int complete;
+	int result;
+
+	*String = Port->RxBuffer;
+	if (Port->Handle == INVALID_HANDLE_VALUE)
+	{
+		Port->RxBuffer[0] = '\0';
+		return SERIAL_ERROR_NOT_OPEN;
+	}
+
+	charsread = Serial_ReadString(Port->Handle, Port->RxBuffer, Port->RxSize, &error, &complete);
+
+	// Record the error in the context but still hand over what did arrive, the string
+	// stays in the receive buffer even if the failure closed the port.
+	if (error != 0)
+	{
+		result = Serial_PortFail(Port, error);
+		if (charsread == 0)
+			return result;
+	}
+
+	return charsread;
 }
 
 /*
- * Function: Serial_GetString
- * Reads a string from the serial port
+ * Function: Serial_PortGetFrame
+ * Reads a binary frame from a port, see Serial_GetFrame.
  *
  * Parameters:
- * Serial_Handle - Handle to the serial port.
- * Buffer - Pointer to buffer to receive the read string.
- * BufSize - Length of the buffer for the returned string.
+ * Port - Pointer to the port.
+ * Framer - Pointer to a framer set up with Serial_FramerInit.
+ * Frame - Pointer to receive the address of the decoded frame.
  *
  * Returns:
- * (int) - The number of characters.
+ * (int) - Length of the frame, 0 if none arrived before the read timed out, or a SERIAL_ERROR_ code.
  *
  */
-int Serial_GetString(HANDLE Serial_Handle, char *Buffer, int BufSize)
+int Serial_PortGetFrame(Serial_Port *Port, Serial_Framer *Framer, unsigned char **Frame)
 {
-	char c = 0;
-	int charsread = 0;
-	DWORD bytesread = 0;
-	double elapsed = 0.0;
-	clock_t start;
-
-	// Clear the buffer contents
-	memset(Buffer, 0, BufSize);
+	DWORD error;
+	int length;
 
-	start = clock();
-	for (;;)
-	{
-		elapsed = ((double)(clock() - start)) / CLOCKS_PER_SEC;
+	if (Port->Handle == INVALID_HANDLE_VALUE)
+		return SERIAL_ERROR_NOT_OPEN;
 
-		if (!ReadFile(Serial_Handle, &c, 1, &bytesread, NULL))
-		{
-			Serial_ShowError("Serial_GetString");
-			break;
-		}
+	length = Serial_ReadFrame(Port->Handle, Framer, Frame, &error);
+	if (error != 0)
+		return Serial_PortFail(Port, error);
 
-		if (bytesread != 0)
-		{
-			// Break out if a carriage return or line feed is found.
-			if (c == 10 || c == 13 || elapsed > 5)
-			{
-				//printf("%s\n",Buffer);
-				break;
-			}
+	return length;
+}
 
-			// Break out if the buffer is filled.
-			if (charsread >= (BufSize - 1))
-				break;
+/*
+ * Function: Serial_PortWrite
+ * Writes a block of data to a port.
+ *
+ * Parameters:
+ * Port - Pointer to the port.
+ * Data - Pointer to the data.
+ * Length - Number of bytes of data.
+ *
+ * Returns:
+ * (int) - The number of bytes written, which is short if the write timed out, or a SERIAL_ERROR_ code.
+ *
+ */
+int Serial_PortWrite(Serial_Port *Port, const void *Data, int Length)
+{
+	DWORD cnt = 0;
 
-			// Add the read char to the buffer
-			*Buffer = c;
-			Buffer++;
+	if (Port->Handle == INVALID_HANDLE_VALUE)
+		return SERIAL_ERROR_NOT_OPEN;
 
-			// Increment the number of characters read
-			charsread++;
-		}
+	if (!Serial_Write(Port->Handle, Data, Length, &cnt))
+		return Serial_PortFail(Port, GetLastError());
 
-		if (elapsed > 5)
-		{
-			break;
-		}
-	}
-	Buffer[charsread] = '\0';
+	return cnt;
+}
 
-	return charsread;
+/*
+ * Function: Serial_PortPutString
+ * Writes a string to a port.
+ *
+ * Parameters:
+ * Port - Pointer to the port.
+ * String - Pointer to the string.
+ *
+ * Returns:
+ * (int) - The number of bytes written, or a SERIAL_ERROR_ code.
+ *
+ */
+int Serial_PortPutString(Serial_Port *Port, const char *String)
+{
+	return Serial_PortWrite(Port, String, (int)strlen(String));
 }
 
 /*
- * Function: Serial_PortExists
- * Checks to see if a comport exists.
+ * Function: Serial_PortPrintf
+ * Formats a string into the port's transmit buffer and writes it.
  *
  * Parameters:
- * ComPort - Port number to check.
+ * Port - Pointer to the port.
+ * Format - printf style format string, followed by its arguments.
  *
  * Returns:
- * (int) - non zero port exists.
+ * (int) - The number of bytes written, or a SERIAL_ERROR_ code.
  *
  */
-int Serial_PortExists(unsigned char ComPort)
+int Serial_PortPrintf(Serial_Port *Port, const char *Format, ...)
 {
-	char szComPort[20] = {'\0'};
-	HANDLE result = 0;
-	int value = 0;
+	va_list args;
+	int length;
 
-	sprintf(szComPort, "\\\\.\\COM%d", ComPort);
+	va_start(args, Format);
+	length = vsnprintf(Port->TxBuffer, Port->TxSize, Format, args);
+	va_end(args);
 
-	result = CreateFile(szComPort, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
-	CloseHandle(result);
-	if (result != INVALID_HANDLE_VALUE)
-		value = 1;
-	else
-		value = 0;
-	return (value);
+	if (length < 0 || length >= Port->TxSize)
+	{
+		Port->LastError = SERIAL_ERROR_OVERFLOW;
+		return SERIAL_ERROR_OVERFLOW;
+	}
+
+	return Serial_PortWrite(Port, Port->TxBuffer, length);
+}
+
+/*
+ * Function: Serial_ErrorString
+ * Describes a SERIAL_ERROR_ code.
+ *
+ * Parameters:
+ * Error - The code.
+ *
+ * Returns:
+ * (const char *) - Pointer to the description.
+ *
+ */
+const char *Serial_ErrorString(int Error)
+{
+	switch (Error)
+	{
+	case SERIAL_OK:
+		return "No error";
+	case SERIAL_ERROR_NOT_OPEN:
+		return "Port not open";
+	case SERIAL_ERROR_OPEN:
+		return "Unable to open port";
+	case SERIAL_ERROR_DISCONNECTED:
+		return "Device disconnected";
+	case SERIAL_ERROR_IO:
+		return "Read or write failed";
+	case SERIAL_ERROR_NO_MEMORY:
+		return "Out of memory";
+	case SERIAL_ERROR_OVERFLOW:
+		return "Buffer too small";
+	case SERIAL_ERROR_EOF:
+		return "End of replay";
+	default:
+		return "Unknown error";
+	}
 }
@@ -37,8 +37,140 @@
 /* #define ONE5STOPBITS		1	// 1.5 stop bits. */
 /* #define TWOSTOPBITS		2	// 2 stop bits */
 
+// Port profiles used by Serial_OpenPortEx and Serial_SetProfile
+#define SERIAL_PROFILE_DEFAULT 0		// SERIAL_IN/OUT_BUFFER_SIZE buffers, reads wait up to 200ms for the first byte.
+#define SERIAL_PROFILE_LOW_LATENCY 1	// Small buffers, reads return as soon as a byte arrives or after 1ms.
+#define SERIAL_PROFILE_THROUGHPUT 2		// Large buffers, reads wait for a full block or a gap in the data.
+
+// Receive ring used by Serial_StartReader
+#define SERIAL_RING_SLOTS 64		// Number of line slots, must be a power of two.
+#define SERIAL_RING_SLOT_SIZE 256	// Longest line a slot can hold, including the terminator.
+
+typedef struct Serial_RingSlot
+{
+	int Length;
+	int Complete;					// 0 if the line was cut at SERIAL_RING_SLOT_SIZE - 1 characters or by the read timeout.
+	char Data[SERIAL_RING_SLOT_SIZE];
+} Serial_RingSlot;
+
+typedef struct Serial_Ring
+{
+	volatile LONG Head;				// Next slot the reader thread fills, only written by the reader thread.
+	char HeadPad[64 - sizeof(LONG)];	// Keep Head and Tail on separate cache lines.
+	volatile LONG Tail;				// Next slot the consumer borrows, only written by the consumer.
+	char TailPad[64 - sizeof(LONG)];
+	volatile LONG Running;
+	volatile LONG Dropped;			// Lines thrown away because the ring was full.
+	volatile LONG Partial;			// Lines handed over without a line end, see Serial_RingComplete.
+	volatile DWORD Error;			// GetLastError value of the read which stopped the reader, see Serial_RingError.
+	HANDLE Serial_Handle;
+	HANDLE Thread;
+	Serial_RingSlot Slots[SERIAL_RING_SLOTS];
+} Serial_Ring;
+
+// Per port statistics returned by Serial_GetStats
+#define SERIAL_MAX_OPEN_PORTS 64		// Number of handles statistics can be kept for.
+#define SERIAL_LATENCY_BUCKETS 24		// Bucket 0 counts reads under 1us, bucket n reads from 2^(n-1) to 2^n us.
+
+// Only LONG64 counters, Serial_GetStats copies it as an array.
+typedef struct Serial_Stats
+{
+	LONG64 BytesRead;
+	LONG64 BytesWritten;
+	LONG64 ReadCalls;
+	LONG64 WriteCalls;
+	LONG64 ReadTimeouts;		// Reads which returned no data.
+	LONG64 ReadErrors;			// Reads which failed.
+	LONG64 WriteErrors;			// Writes which failed or were cut short.
+	// The driver only keeps a flag for each line error, so these count the polls which
+	// found it set, not errors. Polls happen on short reads, failed reads and Serial_GetStats.
+	LONG64 Overruns;			// Polls which saw a driver or UART receive buffer overrun.
+	LONG64 FramingErrors;		// Polls which saw a framing error.
+	LONG64 ParityErrors;		// Polls which saw a parity error.
+	LONG64 Breaks;				// Polls which saw a break.
+	LONG64 ReadLatency[SERIAL_LATENCY_BUCKETS];
+} Serial_Stats;
+
+// Capture log written by Serial_StartCapture and read by Serial_OpenReplay.
+// A Serial_LogHeader is followed by Serial_LogRecords, each followed by its data padded to 8 bytes.
+// A record may have room beyond its data, Size rather than Length gives the next record.
+#define SERIAL_LOG_MAGIC "SERLOG1"
+#define SERIAL_CAPTURE_RX 0
+#define SERIAL_CAPTURE_TX 1
+#define SERIAL_CAPTURE_MERGE_SIZE 64	// Room given to small chunks of a stream so later ones can be added.
+#define SERIAL_CAPTURE_MERGE_CHARS 4	// Largest gap in character times between chunks merged into one record.
+#define SERIAL_CAPTURE_MERGE_GAP 1000	// Smallest such gap in microseconds, also used when there's no baud rate.
+
+typedef struct Serial_LogHeader
+{
+	char Magic[8];			// SERIAL_LOG_MAGIC
+	LONG64 StartTime;		// FILETIME when the capture started.
+	LONG64 Used;			// Bytes of records after the header, 0 if the capture was never stopped.
+	LONG64 Dropped;			// Chunks which didn't fit in the log.
+} Serial_LogHeader;
+
+typedef struct Serial_LogRecord
+{
+	LONG64 Time;			// Microseconds since the capture started.
+	DWORD Size;				// Size of the record including data and padding, 0 marks the end.
+	DWORD Length;			// Bytes of data.
+	DWORD Direction;		// SERIAL_CAPTURE_RX or SERIAL_CAPTURE_TX.
+	DWORD Pad;
+} Serial_LogRecord;
+
+// Binary framing modes used by Serial_GetFrame and Serial_PutFrame
+#define SERIAL_FRAME_COBS 0			// Consistent overhead byte stuffing, frames end with 0x00.
+#define SERIAL_FRAME_SLIP 1			// RFC 1055 SLIP, frames end with 0xC0.
+#define SERIAL_FRAME_LENGTH_CRC 2	// 16 bit little endian length, payload, CRC-16/CCITT of both.
+
+#define SERIAL_FRAME_BUFFER_SIZE 4096	// Largest encoded frame the framer can hold.
+
+typedef struct Serial_Framer
+{
+	int Mode;
+	int Start;						// First byte not yet consumed.
+	int End;						// One past the last byte received.
+	int Scan;						// Where to carry on looking for a delimiter.
+	unsigned long Frames;			// Good frames returned.
+	unsigned long FramingErrors;	// Bad encodings and frames too big for the buffer.
+	unsigned long CrcErrors;		// Length prefixed frames with a bad CRC.
+	unsigned char Buffer[SERIAL_FRAME_BUFFER_SIZE];
+} Serial_Framer;
+
+// Error codes returned by the Serial_Port functions
+#define SERIAL_OK 0
+#define SERIAL_ERROR_NOT_OPEN -1		// The port is closed, call Serial_PortReopen.
+#define SERIAL_ERROR_OPEN -2			// The port couldn't be opened or configured.
+#define SERIAL_ERROR_DISCONNECTED -3	// The device went away and the port has been closed.
+#define SERIAL_ERROR_IO -4				// A read or write failed.
+#define SERIAL_ERROR_NO_MEMORY -5
+#define SERIAL_ERROR_OVERFLOW -6		// The data didn't fit the port's buffer.
+#define SERIAL_ERROR_EOF -7				// The end of a replay opened with Serial_PortOpenReplay.
+
+// Port context used by the Serial_Port functions
+typedef struct Serial_Port
+{
+	HANDLE Handle;					// INVALID_HANDLE_VALUE while closed.
+	unsigned char ComPort;
+	DWORD BaudRate;
+	unsigned char Databits;
+	unsigned char Parity;
+	unsigned char Stopbits;
+	unsigned char Handshake;
+	int Profile;
+	int LastError;					// Last SERIAL_ERROR_ code.
+	DWORD SystemError;				// GetLastError value behind LastError.
+	unsigned long Reconnects;		// Successful calls to Serial_PortReopen.
+	char *RxBuffer;					// Holds the string returned by Serial_PortGetString.
+	int RxSize;
+	char *TxBuffer;					// Holds the string formatted by Serial_PortPrintf.
+	int TxSize;
+} Serial_Port;
+
 /* Function Prototypes */
 HANDLE Serial_OpenPort(unsigned char nComPort, DWORD nBaudRate, unsigned char nDatabits, unsigned char nParity, unsigned char nStopbits, unsigned char nHandshake);
+HANDLE Serial_OpenPortEx(unsigned char nComPort, DWORD nBaudRate, unsigned char nDatabits, unsigned char nParity, unsigned char nStopbits, unsigned char nHandshake, int nProfile);
+int Serial_SetProfile(HANDLE Serial_Handle, int nProfile);
 void Serial_ClosePort(HANDLE Serial_Handle);
 void Serial_PutByte(HANDLE Serial_Handle, unsigned char c);
 void Serial_PutString(HANDLE Serial_Handle, char *c);
@@ -54,9 +186,49 @@ void Serial_SetDTR(HANDLE Serial_Handle);
 void Serial_SetRTS(HANDLE Serial_Handle);
 void Serial_ClearRTS(HANDLE Serial_Handle);
 int Serial_PortExists(unsigned char ComPort);
+Serial_Ring *Serial_StartReader(HANDLE Serial_Handle);
+void Serial_StopReader(Serial_Ring *Ring);
+char *Serial_RingBorrow(Serial_Ring *Ring, int *Length);
+void Serial_RingRelease(Serial_Ring *Ring);
+DWORD Serial_RingError(Serial_Ring *Ring);
+int Serial_RingComplete(Serial_Ring *Ring);
+void Serial_FramerInit(Serial_Framer *Framer, int Mode);
+int Serial_FramerNext(Serial_Framer *Framer, unsigned char **Frame);
+int Serial_GetFrame(HANDLE Serial_Handle, Serial_Framer *Framer, unsigned char **Frame);
+int Serial_PutFrame(HANDLE Serial_Handle, int Mode, const unsigned char *Data, int Length);
+int Serial_EnumPorts(unsigned char *Ports, int MaxPorts);
+void Serial_InvalidatePortCache(void);
+int Serial_AttachHandle(HANDLE Serial_Handle);
+void Serial_DetachHandle(HANDLE Serial_Handle);
+int Serial_GetStats(HANDLE Serial_Handle, Serial_Stats *Stats);
+void Serial_ResetStats(HANDLE Serial_Handle);
+int Serial_StartCapture(HANDLE Serial_Handle, const char *FileName, DWORD MaxSize);
+int Serial_StopCapture(HANDLE Serial_Handle);
+HANDLE Serial_OpenReplay(const char *FileName, int Realtime);
+int Serial_ReplayFinished(HANDLE Serial_Handle);
+int Serial_PortInit(Serial_Port *Port, int RxSize, int TxSize);
+void Serial_PortFree(Serial_Port *Port);
+int Serial_PortOpen(Serial_Port *Port, unsigned char nComPort, DWORD nBaudRate, unsigned char nDatabits, unsigned char nParity, unsigned char nStopbits, unsigned char nHandshake, int nProfile);
+int Serial_PortReopen(Serial_Port *Port);
+int Serial_PortOpenReplay(Serial_Port *Port, const char *FileName, int Realtime);
+void Serial_PortClose(Serial_Port *Port);
+int Serial_PortSetProfile(Serial_Port *Port, int nProfile);
+int Serial_PortGetByte(Serial_Port *Port, unsigned char *c);
+int Serial_PortGetString(Serial_Port *Port, char **String);
+int Serial_PortGetFrame(Serial_Port *Port, Serial_Framer *Framer, unsigned char **Frame);
+int Serial_PortWrite(Serial_Port *Port, const void *Data, int Length);
+int Serial_PortPutString(Serial_Port *Port, const char *String);
+int Serial_PortPrintf(Serial_Port *Port, const char *Format, ...);
+const char *Serial_ErrorString(int Error);
 
 // Serial I/O Buffer Sizes
 #define SERIAL_IN_BUFFER_SIZE 2048
 #define SERIAL_OUT_BUFFER_SIZE 2048
+#define SERIAL_LOW_LATENCY_BUFFER_SIZE 256
+#define SERIAL_THROUGHPUT_BUFFER_SIZE 65536
+#define SERIAL_THROUGHPUT_GAP 10	// Milliseconds of silence which end a throughput profile read.
+
+// Highest port number Serial_EnumPorts can report
+#define SERIAL_MAX_PORTS 255
 
 #endif
@@ -0,0 +1,769 @@
+// MIT License
+//
+// 	Copyright(c) 2019 Les Farrell
+//
+// 	Permission is hereby granted,
+// 	free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+//
+// 	The above copyright notice and this permission notice shall be included in all copies
+// 	or
+// 	substantial portions of the Software.
+//
+// 	THE SOFTWARE IS PROVIDED "AS IS",
+// 	WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// 	DAMAGES OR OTHER
+// 	LIABILITY,
+// 	WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// 	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// 	SOFTWARE.
+
+// Benchmark for the serial library.
+//
+// Measures sustained bytes per second, system calls per byte, p50/p99 line latency and
+// CPU time per MB for each of the read and write paths. By default the data runs over a
+// simulated link, an anonymous pipe fed by a thread which paces it at the chosen baud
+// rate (10 bits per character) and can add random jitter to each line. Give two port
+// numbers with -ports to run over a real loopback instead, e.g. a null modem cable or a
+// com0com pair. A Serial_GetString run is also captured to serial_bench.log, which is
+// then read back with Serial_OpenReplay in fast mode and deleted.
+//
+// Build: cl serial_bench.c serial.c advapi32.lib
+// Usage: serial_bench [-baud N] [-jitter us] [-lines N] [-ports tx rx] [-profile N]
+//        -baud 0 runs the simulated link as fast as it will go.
+//        -profile opens the ports with a SERIAL_PROFILE_ value, 0 default, 1 low latency, 2 throughput.
+
+#include "serial.h"
+
+#define BENCH_LINE_LENGTH 64	// Bytes per line or frame payload, including the line terminator.
+#define BENCH_STALL_SECONDS 5	// Give up on a path when nothing arrives for this long.
+#define BENCH_QUIET_MS 200		// A real link is drained once nothing has arrived for this long.
+#define BENCH_PREFIX_LENGTH 12	// "RR:NNNNNNNN " run and line number at the start of each line.
+#define BENCH_REPLAY_FILE "serial_bench.log"
+
+typedef struct Bench_Link
+{
+	HANDLE Tx;
+	HANDLE Rx;
+	DWORD BaudRate;	// 0 sends as fast as possible.
+	DWORD Jitter;	// Largest random delay added to each line, in microseconds.
+	int Simulated;
+	int Lines;
+	int Run;		// Number of the read path being run, sent in each line so stale lines are ignored.
+} Bench_Link;
+
+typedef struct Bench_Writer
+{
+	Bench_Link *Link;
+	int Frames;				// Send COBS frames rather than text lines.
+	LONGLONG *SentTime;		// When each line was written.
+	volatile LONG Done;		// Set once the reader has every line, filler lines are sent until then.
+	HANDLE Thread;
+} Bench_Writer;
+
+typedef struct Bench_Result
+{
+	double *Latency;	// Microseconds from write to read for each line.
+	int Count;
+	LONGLONG Progress;	// When the reader last received something.
+} Bench_Result;
+
+typedef void (*Bench_Reader)(Bench_Link *Link, Bench_Writer *Writer, Bench_Result *Result);
+
+static LARGE_INTEGER Bench_Frequency;
+
+/*
+ * Function: Bench_Now
+ * Reads the performance counter.
+ *
+ * Parameters:
+ * void.
+ *
+ * Returns:
+ * (LONGLONG) - The counter value.
+ *
+ */
+static LONGLONG Bench_Now(void)
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+/*
+ * Function: Bench_Microseconds
+ * Converts a performance counter interval to microseconds.
+ *
+ * Parameters:
+ * Ticks - The interval in counter ticks.
+ *
+ * Returns:
+ * (double) - The interval in microseconds.
+ *
+ */
+static double Bench_Microseconds(LONGLONG Ticks)
+{
+	return (double)Ticks * 1000000.0 / (double)Bench_Frequency.QuadPart;
+}
+
+/*
+ * Function: Bench_Stalled
+ * Checks whether a reader has gone too long without receiving anything.
+ *
+ * Parameters:
+ * Result - Pointer to the result being filled by the reader.
+ *
+ * Returns:
+ * (int) - non zero if the reader should give up.
+ *
+ */
+static int Bench_Stalled(Bench_Result *Result)
+{
+	return Bench_Microseconds(Bench_Now() - Result->Progress) > BENCH_STALL_SECONDS * 1000000.0;
+}
+
+/*
+ * Function: Bench_FileTimeSeconds
+ * Converts a FILETIME duration to seconds.
+ *
+ * Parameters:
+ * Time - Pointer to the FILETIME.
+ *
+ * Returns:
+ * (double) - The duration in seconds.
+ *
+ */
+static double Bench_FileTimeSeconds(FILETIME *Time)
+{
+	return (double)(((ULONGLONG)Time->dwHighDateTime << 32) | Time->dwLowDateTime) / 10000000.0;
+}
+
+/*
+ * Function: Bench_CpuSeconds
+ * Gets the CPU time used by the process, less the time used by one helper thread so
+ * the pacing or draining thread isn't charged to the path being measured.
+ *
+ * Parameters:
+ * Exclude - Handle of the thread to leave out.
+ *
+ * Returns:
+ * (double) - CPU time in seconds, user and kernel.
+ *
+ */
+static double Bench_CpuSeconds(HANDLE Exclude)
+{
+	FILETIME created, exited, kernel, user;
+	double seconds = 0.0;
+
+	if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+		seconds = Bench_FileTimeSeconds(&kernel) + Bench_FileTimeSeconds(&user);
+
+	if (GetThreadTimes(Exclude, &created, &exited, &kernel, &user))
+		seconds -= Bench_FileTimeSeconds(&kernel) + Bench_FileTimeSeconds(&user);
+
+	return seconds;
+}
+
+/*
+ * Function: Bench_CompareDouble
+ * qsort comparison for doubles.
+ */
+static int Bench_CompareDouble(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Function: Bench_MakeLine
+ * Builds test line or frame payload number Index. Lines are text ending in a line feed,
+ * frame payloads include 0x00, 0x0A and 0x0D bytes to exercise the framer.
+ *
+ * Parameters:
+ * Run - Run number, written at the start of the line.
+ * Index - Line number, written after the run number.
+ * Buffer - Pointer to a buffer of at least BENCH_LINE_LENGTH + 1 bytes.
+ * Frames - non zero to build a frame payload.
+ *
+ * Returns:
+ * void.
+ */
+static void Bench_MakeLine(int Run, int Index, unsigned char *Buffer, int Frames)
+{
+	int i;
+
+	sprintf((char *)Buffer, "%02d:%08d ", Run % 100, Index);
+	for (i = BENCH_PREFIX_LENGTH; i < BENCH_LINE_LENGTH - 1; i++)
+		Buffer[i] = (unsigned char)('A' + i % 26);
+
+	if (Frames)
+	{
+		Buffer[BENCH_PREFIX_LENGTH] = 0x00;
+		Buffer[BENCH_PREFIX_LENGTH + 1] = 0x0A;
+		Buffer[BENCH_PREFIX_LENGTH + 2] = 0x0D;
+	}
+
+	Buffer[BENCH_LINE_LENGTH - 1] = '\n';
+	Buffer[BENCH_LINE_LENGTH] = '\0';
+}
+
+/*
+ * Function: Bench_WriterThread
+ * Sends numbered lines or frames to the link, pacing them on a simulated link. Carries
+ * on sending filler lines until Done is set so a reader blocked on a pipe always wakes.
+ *
+ * Parameters:
+ * Param - Pointer to the Bench_Writer.
+ *
+ * Returns:
+ * (DWORD) - Always 0.
+ */
+static DWORD WINAPI Bench_WriterThread(LPVOID Param)
+{
+	Bench_Writer *Writer = (Bench_Writer *)Param;
+	Bench_Link *Link = Writer->Link;
+	unsigned char line[BENCH_LINE_LENGTH + 1];
+	LONGLONG start = Bench_Now();
+	LONGLONG sent = 0;
+	LONGLONG due;
+	int i;
+
+	for (i = 0; i < Link->Lines || !Writer->Done; i++)
+	{
+		Bench_MakeLine(Link->Run, i, line, Writer->Frames);
+
+		if (Link->Simulated && Link->BaudRate != 0)
+		{
+			due = start + sent * 10 * Bench_Frequency.QuadPart / Link->BaudRate;
+			if (Link->Jitter != 0)
+				due += (LONGLONG)(rand() % (Link->Jitter + 1)) * Bench_Frequency.QuadPart / 1000000;
+
+			// Sleep has millisecond granularity at best, so spin.
+			while (Bench_Now() < due)
+				SwitchToThread();
+		}
+
+		if (i < Link->Lines)
+			Writer->SentTime[i] = Bench_Now();
+
+		if (Writer->Frames)
+		{
+			sent += Serial_PutFrame(Link->Tx, SERIAL_FRAME_COBS, line, BENCH_LINE_LENGTH);
+		}
+		else
+		{
+			Serial_PutString(Link->Tx, (char *)line);
+			sent += BENCH_LINE_LENGTH;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function: Bench_AddLine
+ * Records the latency of a received line. Lines left over from an earlier run, which
+ * a real link can still deliver after it has been drained, are ignored.
+ *
+ * Parameters:
+ * Link - Pointer to the link.
+ * Writer - Pointer to the writer which sent the line.
+ * Result - Pointer to the result being filled.
+ * Line - Pointer to the received line, starting with its run and line number.
+ *
+ * Returns:
+ * void.
+ */
+static void Bench_AddLine(Bench_Link *Link, Bench_Writer *Writer, Bench_Result *Result, const char *Line)
+{
+	LONGLONG now = Bench_Now();
+	int index;
+
+	Result->Progress = now;
+	if (strlen(Line) < BENCH_PREFIX_LENGTH || Line[2] != ':' || atoi(Line) != Link->Run % 100)
+		return;
+
+	index = atoi(Line + 3);
+	if (index >= 0 && index < Link->Lines && Result->Count < Link->Lines)
+		Result->Latency[Result->Count++] = Bench_Microseconds(now - Writer->SentTime[index]);
+}
+
+/*
+ * Function: Bench_ReadGetString
+ * Reads the lines with Serial_GetString.
+ */
+static void Bench_ReadGetString(Bench_Link *Link, Bench_Writer *Writer, Bench_Result *Result)
+{
+	char line[BENCH_LINE_LENGTH * 2];
+
+	while (Result->Count < Link->Lines && !Bench_Stalled(Result))
+	{
+		if (Serial_GetString(Link->Rx, line, sizeof(line)) != 0)
+			Bench_AddLine(Link, Writer, Result, line);
+	}
+}
+
+/*
+ * Function: Bench_ReadGetByte
+ * Reads the lines a byte at a time with Serial_GetByte.
+ */
+static void Bench_ReadGetByte(Bench_Link *Link, Bench_Writer *Writer, Bench_Result *Result)
+{
+	char line[BENCH_LINE_LENGTH * 2];
+	unsigned char c;
+	int length = 0;
+
+	while (Result->Count < Link->Lines && !Bench_Stalled(Result))
+	{
+		if (Serial_GetByte(Link->Rx, &c) == 0)
+			continue;
+
+		if (c == '\n')
+		{
+			line[length] = '\0';
+			Bench_AddLine(Link, Writer, Result, line);
+			length = 0;
+		}
+		else if (length < (int)sizeof(line) - 1)
+		{
+			line[length++] = (char)c;
+		}
+	}
+}
+
+/*
+ * Function: Bench_ReadRing
+ * Reads the lines through the Serial_StartReader ring.
+ */
+static void Bench_ReadRing(Bench_Link *Link, Bench_Writer *Writer, Bench_Result *Result)
+{
+	Serial_Ring *ring;
+	char *line;
+
+	ring = Serial_StartReader(Link->Rx);
+	if (ring == NULL)
+		return;
+
+	while (Result->Count < Link->Lines && !Bench_Stalled(Result))
+	{
+		line = Serial_RingBorrow(ring, NULL);
+		if (line == NULL)
+		{
+			if (Serial_RingError(ring) != 0)
+				break;
+			SwitchToThread();
+			continue;
+		}
+
+		Bench_AddLine(Link, Writer, Result, line);
+		Serial_RingRelease(ring);
+	}
+
+	Serial_StopReader(ring);
+}
+
+/*
+ * Function: Bench_ReadGetFrame
+ * Reads COBS frames with Serial_GetFrame.
+ */
+static void Bench_ReadGetFrame(Bench_Link *Link, Bench_Writer *Writer, Bench_Result *Result)
+{
+	static Serial_Framer framer;
+	unsigned char *frame;
+
+	Serial_FramerInit(&framer, SERIAL_FRAME_COBS);
+	while (Result->Count < Link->Lines && !Bench_Stalled(Result))
+	{
+		if (Serial_GetFrame(Link->Rx, &framer, &frame) != 0)
+			Bench_AddLine(Link, Writer, Result, (char *)frame);
+	}
+}
+
+/*
+ * Function: Bench_Print
+ * Prints one row of results.
+ *
+ * Parameters:
+ * Name - Name of the path measured.
+ * Stats - Pointer to the statistics for the handle measured.
+ * Read - non zero for a read path.
+ * Seconds - Wall clock time taken.
+ * CpuSeconds - CPU time taken.
+ * Result - Pointer to the line latencies, NULL for a write path.
+ *
+ * Returns:
+ * void.
+ */
+static void Bench_Print(const char *Name, Serial_Stats *Stats, int Read, double Seconds, double CpuSeconds, Bench_Result *Result)
+{
+	LONG64 bytes = Read ? Stats->BytesRead : Stats->BytesWritten;
+	LONG64 calls = Read ? Stats->ReadCalls : Stats->WriteCalls;
+	double megabytes = (double)bytes / (1024.0 * 1024.0);
+
+	printf("%-20s %12.0f %10.4f", Name, Seconds > 0.0 ? (double)bytes / Seconds : 0.0, bytes > 0 ? (double)calls / (double)bytes : 0.0);
+
+	if (Result != NULL && Result->Count > 0)
+	{
+		qsort(Result->Latency, Result->Count, sizeof(double), Bench_CompareDouble);
+		printf(" %10.1f %10.1f", Result->Latency[Result->Count / 2], Result->Latency[(Result->Count * 99) / 100]);
+	}
+	else
+	{
+		printf(" %10s %10s", "-", "-");
+	}
+
+	printf(" %10.1f\n", megabytes > 0.0 ? CpuSeconds * 1000.0 / megabytes : 0.0);
+}
+
+/*
+ * Function: Bench_Drain
+ * Throws away anything left on the receive side of the link. A pipe can't be purged
+ * and a read would block, so only what is already there is read. A real port can still
+ * have data in flight after a purge, so it is read until it has gone quiet.
+ *
+ * Parameters:
+ * Rx - Handle to the receive side of the link.
+ *
+ * Returns:
+ * void.
+ */
+static void Bench_Drain(HANDLE Rx)
+{
+	unsigned char buffer[4096];
+	DWORD available = 0;
+	DWORD bytesread;
+	LONGLONG quiet;
+
+	Serial_FlushRX(Rx);
+	if (PeekNamedPipe(Rx, NULL, 0, NULL, &available, NULL))
+	{
+		while (available != 0)
+		{
+			if (!ReadFile(Rx, buffer, available < sizeof(buffer) ? available : sizeof(buffer), &bytesread, NULL))
+				break;
+			if (!PeekNamedPipe(Rx, NULL, 0, NULL, &available, NULL))
+				break;
+		}
+		return;
+	}
+
+	quiet = Bench_Now();
+	while (Bench_Microseconds(Bench_Now() - quiet) < BENCH_QUIET_MS * 1000.0)
+	{
+		bytesread = 0;
+		if (!ReadFile(Rx, buffer, sizeof(buffer), &bytesread, NULL))
+			break;
+		if (bytesread != 0)
+			quiet = Bench_Now();
+		else
+			Sleep(1);
+	}
+}
+
+/*
+ * Function: Bench_RunRead
+ * Runs one read path against a writer thread and prints its results.
+ *
+ * Parameters:
+ * Link - Pointer to the link.
+ * Name - Name of the path measured.
+ * Frames - non zero to send COBS frames rather than text lines.
+ * Read - The reader for the path.
+ *
+ * Returns:
+ * void.
+ */
+static void Bench_RunRead(Bench_Link *Link, const char *Name, int Frames, Bench_Reader Read)
+{
+	Bench_Writer writer;
+	Bench_Result result;
+	Serial_Stats stats;
+	LONGLONG start;
+	double cpu;
+
+	memset(&writer, 0, sizeof(writer));
+	memset(&result, 0, sizeof(result));
+	Link->Run++;
+	writer.Link = Link;
+	writer.Frames = Frames;
+	writer.SentTime = (LONGLONG *)calloc(Link->Lines, sizeof(LONGLONG));
+	result.Latency = (double *)calloc(Link->Lines, sizeof(double));
+	if (writer.SentTime == NULL || result.Latency == NULL)
+	{
+		fprintf(stderr, "%s: out of memory\n", Name);
+		free(writer.SentTime);
+		free(result.Latency);
+		return;
+	}
+
+	Serial_FlushRX(Link->Rx);
+	Serial_ResetStats(Link->Rx);
+
+	writer.Thread = CreateThread(NULL, 0, Bench_WriterThread, &writer, 0, NULL);
+	if (writer.Thread == NULL)
+	{
+		fprintf(stderr, "%s: CreateThread failed\n", Name);
+		free(writer.SentTime);
+		free(result.Latency);
+		return;
+	}
+
+	cpu = Bench_CpuSeconds(writer.Thread);
+	start = Bench_Now();
+	result.Progress = start;
+
+	Read(Link, &writer, &result);
+
+	Serial_GetStats(Link->Rx, &stats);
+	Bench_Print(Name, &stats, 1, Bench_Microseconds(Bench_Now() - start) / 1000000.0, Bench_CpuSeconds(writer.Thread) - cpu, &result);
+	if (result.Count < Link->Lines)
+		printf("%-20s only %d of %d lines arrived\n", "", result.Count, Link->Lines);
+
+	// Let the writer finish, throwing away its filler so it can't block on a full pipe.
+	InterlockedExchange(&writer.Done, 1);
+	do
+	{
+		Bench_Drain(Link->Rx);
+	} while (WaitForSingleObject(writer.Thread, 10) != WAIT_OBJECT_0);
+	CloseHandle(writer.Thread);
+	Bench_Drain(Link->Rx);
+
+	free(writer.SentTime);
+	free(result.Latency);
+}
+
+/*
+ * Function: Bench_DrainThread
+ * Reads and discards everything arriving on the receive side of the link while a write
+ * path is measured, until Done is set and the link has gone quiet.
+ *
+ * Parameters:
+ * Param - Pointer to the Bench_Writer, used only for its Link and Done members.
+ *
+ * Returns:
+ * (DWORD) - Always 0.
+ */
+static DWORD WINAPI Bench_DrainThread(LPVOID Param)
+{
+	Bench_Writer *Writer = (Bench_Writer *)Param;
+	LONGLONG expected = (LONGLONG)Writer->Link->Lines * BENCH_LINE_LENGTH;
+	LONGLONG received = 0;
+	unsigned char buffer[65536];
+	DWORD bytesread;
+
+	while (received < expected)
+	{
+		bytesread = 0;
+		if (!ReadFile(Writer->Link->Rx, buffer, sizeof(buffer), &bytesread, NULL))
+			break;
+		if (bytesread == 0 && Writer->Done)
+			break;
+		received += bytesread;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: Bench_RunWrite
+ * Runs one write path against a drain thread and prints its results. The simulated
+ * link isn't paced here, so this measures the cost of the library rather than the baud rate.
+ *
+ * Parameters:
+ * Link - Pointer to the link.
+ * Name - Name of the path measured.
+ * Bytes - non zero to send with Serial_PutByte rather than Serial_PutString.
+ *
+ * Returns:
+ * void.
+ */
+static void Bench_RunWrite(Bench_Link *Link, const char *Name, int Bytes)
+{
+	unsigned char line[BENCH_LINE_LENGTH + 1];
+	Bench_Writer drain;
+	Serial_Stats stats;
+	LONGLONG start;
+	double cpu;
+	int i, j;
+
+	memset(&drain, 0, sizeof(drain));
+	drain.Link = Link;
+
+	Serial_ResetStats(Link->Tx);
+
+	drain.Thread = CreateThread(NULL, 0, Bench_DrainThread, &drain, 0, NULL);
+	if (drain.Thread == NULL)
+	{
+		fprintf(stderr, "%s: CreateThread failed\n", Name);
+		return;
+	}
+
+	cpu = Bench_CpuSeconds(drain.Thread);
+	start = Bench_Now();
+
+	for (i = 0; i < Link->Lines; i++)
+	{
+		Bench_MakeLine(Link->Run, i, line, 0);
+		if (Bytes)
+		{
+			for (j = 0; j < BENCH_LINE_LENGTH; j++)
+				Serial_PutByte(Link->Tx, line[j]);
+		}
+		else
+		{
+			Serial_PutString(Link->Tx, (char *)line);
+		}
+	}
+
+	Serial_GetStats(Link->Tx, &stats);
+	Bench_Print(Name, &stats, 0, Bench_Microseconds(Bench_Now() - start) / 1000000.0, Bench_CpuSeconds(drain.Thread) - cpu, NULL);
+
+	InterlockedExchange(&drain.Done, 1);
+	WaitForSingleObject(drain.Thread, INFINITE);
+	CloseHandle(drain.Thread);
+	Bench_Drain(Link->Rx);
+}
+
+/*
+ * Function: Bench_RunReplay
+ * Captures a Serial_GetString run, printing it as a row of its own to show the cost of
+ * capturing, then reads the log back with Serial_OpenReplay in fast mode and prints that.
+ *
+ * Parameters:
+ * Link - Pointer to the link.
+ *
+ * Returns:
+ * void.
+ */
+static void Bench_RunReplay(Bench_Link *Link)
+{
+	char line[BENCH_LINE_LENGTH * 2];
+	Serial_Stats stats;
+	HANDLE replay;
+	LONGLONG start;
+	double cpu;
+	int dropped;
+
+	if (!Serial_StartCapture(Link->Rx, BENCH_REPLAY_FILE, (DWORD)Link->Lines * BENCH_LINE_LENGTH * 4 + 65536))
+	{
+		fprintf(stderr, "Unable to create %s\n", BENCH_REPLAY_FILE);
+		return;
+	}
+	Bench_RunRead(Link, "Capture GetString", 0, Bench_ReadGetString);
+	dropped = Serial_StopCapture(Link->Rx);
+	if (dropped != 0)
+		printf("%-20s %d chunks didn't fit in the log\n", "", dropped);
+
+	replay = Serial_OpenReplay(BENCH_REPLAY_FILE, 0);
+	if (replay == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Unable to open %s\n", BENCH_REPLAY_FILE);
+		DeleteFile(BENCH_REPLAY_FILE);
+		return;
+	}
+
+	// Nothing runs alongside the replay, so there's no helper thread to leave out.
+	cpu = Bench_CpuSeconds(NULL);
+	start = Bench_Now();
+
+	while (!Serial_ReplayFinished(replay))
+		Serial_GetString(replay, line, sizeof(line));
+
+	Serial_GetStats(replay, &stats);
+	Bench_Print("Serial_OpenReplay", &stats, 1, Bench_Microseconds(Bench_Now() - start) / 1000000.0, Bench_CpuSeconds(NULL) - cpu, NULL);
+
+	Serial_ClosePort(replay);
+	DeleteFile(BENCH_REPLAY_FILE);
+}
+
+int main(int argc, char *argv[])
+{
+	Bench_Link link;
+	int txport = 0;
+	int rxport = 0;
+	int profile = SERIAL_PROFILE_DEFAULT;
+	int i;
+
+	memset(&link, 0, sizeof(link));
+	link.BaudRate = 115200;
+	link.Lines = 1000;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-baud") == 0 && i + 1 < argc)
+		{
+			link.BaudRate = atol(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-jitter") == 0 && i + 1 < argc)
+		{
+			link.Jitter = atol(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-lines") == 0 && i + 1 < argc)
+		{
+			link.Lines = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-ports") == 0 && i + 2 < argc)
+		{
+			txport = atoi(argv[++i]);
+			rxport = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+		{
+			profile = atoi(argv[++i]);
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-baud N] [-jitter us] [-lines N] [-ports tx rx] [-profile N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (link.Lines <= 0)
+		link.Lines = 1;
+
+	QueryPerformanceFrequency(&Bench_Frequency);
+	srand(1);
+
+	if (txport != 0)
+	{
+		link.Tx = Serial_OpenPortEx((unsigned char)txport, link.BaudRate, 8, NOPARITY, ONESTOPBIT, HANDSHAKE_NONE, profile);
+		link.Rx = Serial_OpenPortEx((unsigned char)rxport, link.BaudRate, 8, NOPARITY, ONESTOPBIT, HANDSHAKE_NONE, profile);
+		if (link.Tx == INVALID_HANDLE_VALUE || link.Rx == INVALID_HANDLE_VALUE)
+		{
+			fprintf(stderr, "Unable to open COM%d and COM%d\n", txport, rxport);
+			return 1;
+		}
+		printf("Loopback COM%d -> COM%d at %lu baud, profile %d, %d lines of %d bytes\n\n", txport, rxport, link.BaudRate, profile, link.Lines, BENCH_LINE_LENGTH);
+	}
+	else
+	{
+		if (!CreatePipe(&link.Rx, &link.Tx, NULL, 65536))
+		{
+			fprintf(stderr, "CreatePipe failed\n");
+			return 1;
+		}
+		Serial_AttachHandle(link.Tx);
+		Serial_AttachHandle(link.Rx);
+		link.Simulated = 1;
+		printf("Simulated link at %lu baud, jitter up to %luus, %d lines of %d bytes\n\n", link.BaudRate, link.Jitter, link.Lines, BENCH_LINE_LENGTH);
+	}
+
+	printf("%-20s %12s %10s %10s %10s %10s\n", "Path", "Bytes/s", "Calls/byte", "p50 us", "p99 us", "CPU ms/MB");
+
+	Bench_RunRead(&link, "Serial_GetString", 0, Bench_ReadGetString);
+	Bench_RunRead(&link, "Serial_GetByte", 0, Bench_ReadGetByte);
+	Bench_RunRead(&link, "Serial_StartReader", 0, Bench_ReadRing);
+	Bench_RunRead(&link, "Serial_GetFrame", 1, Bench_ReadGetFrame);
+	Bench_RunReplay(&link);
+	Bench_RunWrite(&link, "Serial_PutString", 0);
+	Bench_RunWrite(&link, "Serial_PutByte", 1);
+
+	Serial_ClosePort(link.Tx);
+	Serial_ClosePort(link.Rx);
+
+	return 0;
+}